@@ -0,0 +1,180 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Commands one client may send per second on average and at once, 0 turns the limit off.
+#ifndef LED_STRIP_CLIENT_COMMAND_RATE
+#define LED_STRIP_CLIENT_COMMAND_RATE 200
+#endif
+
+#ifndef LED_STRIP_CLIENT_COMMAND_BURST
+#define LED_STRIP_CLIENT_COMMAND_BURST 100
+#endif
+
+// The same for all clients together, beyond it the controller reports itself busy.
+#ifndef LED_STRIP_COMMAND_RATE
+#define LED_STRIP_COMMAND_RATE 500
+#endif
+
+#ifndef LED_STRIP_COMMAND_BURST
+#define LED_STRIP_COMMAND_BURST 200
+#endif
+
+// Clients tracked at once, the one idle the longest makes room for a new one.
+#ifndef LED_STRIP_RATE_LIMITED_CLIENTS
+#define LED_STRIP_RATE_LIMITED_CLIENTS 8
+#endif
+
+enum Admission
+{
+  Admitted,
+  ClientLimited,
+  Saturated
+};
+
+// Refills at rate commands per second up to burst, counted in thousandths of a command.
+class TokenBucket
+{
+public:
+  static const uint32_t Cost = 1000;
+
+  void Begin(uint32_t rate, uint32_t burst, unsigned long now)
+  {
+    _rate = rate;
+    _capacity = burst * Cost;
+    _tokens = _capacity;
+    _lastMillis = now;
+  }
+
+  bool HasToken(unsigned long now)
+  {
+    if (_rate == 0)
+    {
+      return true;
+    }
+
+    // Long idle periods are cut short so the refill cannot overflow, the bucket is full by then.
+    unsigned long elapsed = now - _lastMillis;
+    elapsed = elapsed < 60000 ? elapsed : 60000;
+    uint64_t tokens = _tokens + (uint64_t)elapsed * _rate;
+    _tokens = tokens < _capacity ? tokens : _capacity;
+    _lastMillis = now;
+    return _tokens >= Cost;
+  }
+
+  void Take()
+  {
+    _tokens = _tokens > Cost ? _tokens - Cost : 0;
+  }
+
+  // At least half full, the owner stayed well below its rate lately.
+  bool IsQuiet() const
+  {
+    return _rate != 0 && _tokens >= _capacity / 2;
+  }
+
+  unsigned long GetLastMillis() const
+  {
+    return _lastMillis;
+  }
+
+protected:
+  uint32_t _rate = 0;
+  uint32_t _capacity = 0;
+  uint32_t _tokens = 0;
+  unsigned long _lastMillis = 0;
+};
+
+// Decides right away whether a command is taken, nothing waits for room. A client over its own
+// rate is told to slow down, commands beyond the rate of all clients together mean the controller
+// is saturated. Clients that stayed well below their own rate are still taken then, so a few
+// busy ones cannot lock everybody else out. A command turned down costs no tokens, but a client
+// turned away as saturated does not count as quiet for as long as it was told to wait, so it
+// cannot save up tokens to slip past. Only used from the network task.
+class AdmissionControl
+{
+public:
+  AdmissionControl()
+  {
+    _all.Begin(LED_STRIP_COMMAND_RATE, LED_STRIP_COMMAND_BURST, 0);
+  }
+
+  // Matches the Retry-After of a turned down command.
+  static const unsigned long RetryMillis = 1000;
+
+  Admission Admit(uint32_t address, unsigned long now)
+  {
+    Client &client = GetClient(address, now);
+    if (!client.bucket.HasToken(now))
+    {
+      _rejected++;
+      return ClientLimited;
+    }
+
+    bool quiet = client.bucket.IsQuiet() && now - client.saturatedMillis >= RetryMillis;
+    if (!_all.HasToken(now) && !quiet)
+    {
+      client.saturatedMillis = now;
+      _rejected++;
+      return Saturated;
+    }
+
+    client.bucket.Take();
+    _all.Take();
+    _accepted++;
+    return Admitted;
+  }
+
+  // For commands that were admitted but found no room further on, e.g. a full queue.
+  void Reject()
+  {
+    _accepted--;
+    _rejected++;
+  }
+
+  uint32_t GetAccepted() const
+  {
+    return _accepted;
+  }
+
+  uint32_t GetRejected() const
+  {
+    return _rejected;
+  }
+
+protected:
+  struct Client
+  {
+    uint32_t address;
+    TokenBucket bucket;
+    unsigned long saturatedMillis;
+  };
+
+  Client &GetClient(uint32_t address, unsigned long now)
+  {
+    uint8_t idlest = 0;
+    for (uint8_t i = 0; i < _clientCount; i++)
+    {
+      if (_clients[i].address == address)
+      {
+        return _clients[i];
+      }
+      if (now - _clients[i].bucket.GetLastMillis() > now - _clients[idlest].bucket.GetLastMillis())
+      {
+        idlest = i;
+      }
+    }
+
+    Client &client = _clients[_clientCount < LED_STRIP_RATE_LIMITED_CLIENTS ? _clientCount++ : idlest];
+    client.address = address;
+    client.bucket.Begin(LED_STRIP_CLIENT_COMMAND_RATE, LED_STRIP_CLIENT_COMMAND_BURST, now);
+    client.saturatedMillis = now - RetryMillis;
+    return client;
+  }
+
+  Client _clients[LED_STRIP_RATE_LIMITED_CLIENTS];
+  uint8_t _clientCount = 0;
+  TokenBucket _all;
+  uint32_t _accepted = 0;
+  uint32_t _rejected = 0;
+};
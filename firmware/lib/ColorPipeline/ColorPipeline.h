@@ -0,0 +1,111 @@
+#pragma once
+
+#include <NeoPixelBus.h>
+
+// Wire format of the strip, picked per board build, e.g. -DLED_STRIP_FEATURE=NeoGrbFeature
+#ifndef LED_STRIP_FEATURE
+#define LED_STRIP_FEATURE NeoGrbwFeature
+#endif
+
+// Gamma 2.2 response of the strip LEDs, index is the linear level.
+static const uint8_t GammaTable[256] PROGMEM = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255};
+
+// Integer color path from segment state to the bytes sent to the strip:
+// hue and saturation give a linear RGB color, on strips with a white LED the white channel takes
+// over the part shared by all three primaries, then one per-segment table applies brightness and gamma.
+class ColorPipeline
+{
+public:
+  // hue is a 16 bit fraction of the color wheel, the color is at full value.
+  static RgbColor HueToRgb(uint16_t hue, uint8_t saturation)
+  {
+    uint16_t wheel = ((uint32_t)hue * 1536) >> 16;
+    uint8_t sector = wheel >> 8;
+    uint8_t fraction = wheel & 0xff;
+
+    uint8_t p = 255 - saturation;
+    uint8_t q = 255 - ((saturation * fraction + 255) >> 8);
+    uint8_t t = 255 - ((saturation * (255 - fraction) + 255) >> 8);
+
+    switch (sector)
+    {
+    case 0:
+      return RgbColor(255, t, p);
+    case 1:
+      return RgbColor(q, 255, p);
+    case 2:
+      return RgbColor(p, 255, t);
+    case 3:
+      return RgbColor(p, q, 255);
+    case 4:
+      return RgbColor(t, p, 255);
+    default:
+      return RgbColor(255, p, q);
+    }
+  }
+
+  // Moves the gray component of the color to the white LED.
+  static RgbwColor ExtractWhite(RgbColor color)
+  {
+    uint8_t white = color.R < color.G ? color.R : color.G;
+    white = color.B < white ? color.B : white;
+    return RgbwColor(color.R - white, color.G - white, color.B - white, white);
+  }
+
+  static RgbwColor HueToRgbw(uint16_t hue, uint8_t saturation)
+  {
+    return ToRenderColor(HueToRgb(hue, saturation), (LED_STRIP_FEATURE::ColorObject *)NULL);
+  }
+
+  static RgbwColor ToRenderColor(RgbColor color, RgbwColor *)
+  {
+    return ExtractWhite(color);
+  }
+
+  // Without a white LED the gray part stays in the primaries, adding it back after the level
+  // table would no longer match the gamma of the mixed color.
+  static RgbwColor ToRenderColor(RgbColor color, RgbColor *)
+  {
+    return RgbwColor(color.R, color.G, color.B, 0);
+  }
+
+  // Folds brightness and gamma into a single lookup. Anything lit stays at least at 1
+  // so low brightness settings never go fully dark.
+  static void BuildLevelTable(uint8_t brightness, uint8_t table[256])
+  {
+    uint16_t factor = brightness + 1;
+    table[0] = 0;
+    for (int i = 1; i < 256; i++)
+    {
+      uint8_t level = pgm_read_byte(&GammaTable[(i * factor) >> 8]);
+      table[i] = level == 0 && brightness > 0 ? 1 : level;
+    }
+  }
+
+  static RgbwColor Apply(const uint8_t table[256], RgbwColor color)
+  {
+    return RgbwColor(table[color.R], table[color.G], table[color.B], table[color.W]);
+  }
+
+  static RgbwColor Scale(RgbwColor color, uint8_t level)
+  {
+    uint16_t factor = level + 1;
+    return RgbwColor((color.R * factor) >> 8, (color.G * factor) >> 8, (color.B * factor) >> 8, (color.W * factor) >> 8);
+  }
+};
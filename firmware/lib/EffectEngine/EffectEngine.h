@@ -0,0 +1,373 @@
+#pragma once
+
+#include <LedStripDriver.h>
+#include <ColorPipeline.h>
+
+// Level tables kept at once, 256 bytes each. Segments at the same brightness share one.
+#ifndef LED_STRIP_LEVEL_TABLES
+#define LED_STRIP_LEVEL_TABLES 8
+#endif
+
+// Everything a transition interpolates. hue is a 16 bit fraction of the color wheel and
+// color is the linear RGBW color at full value, brightness is applied on output.
+struct SegmentLook
+{
+  RgbwColor color;
+  uint16_t hue = 0;
+  uint8_t saturation = 0;
+  uint8_t brightness = 0;
+};
+
+struct SegmentAnimation
+{
+  bool active = false;
+  bool needsRender = false;
+  // Set while the segment has no pixels, nothing of it is shown until it gets some.
+  bool empty = false;
+  uint8_t effect = EffectSolid;
+  uint8_t speed = 50;
+  uint8_t easing = EasingInOut;
+  SegmentLook current;
+  SegmentLook from;
+  SegmentLook target;
+  uint16_t transitionMillis = 0;
+  uint16_t transitionElapsed = 0;
+  uint32_t phase = 0;
+  // Cache entry the level table was found in last time.
+  uint8_t levelTable = UINT8_MAX;
+};
+
+// Level tables for the brightness values in use. A brightness that has none takes over the
+// table used least recently, the segment rendered next asks for its own table again.
+class LevelTableCache
+{
+public:
+  static const uint8_t TableCount = LED_STRIP_LEVEL_TABLES;
+
+  const uint8_t *Get(uint8_t brightness, uint8_t &hint)
+  {
+    _clock++;
+    if (hint >= TableCount || _tables[hint].brightness != brightness)
+    {
+      hint = Find(brightness);
+    }
+    _tables[hint].lastUsed = _clock;
+    return _tables[hint].levels;
+  }
+
+protected:
+  struct Table
+  {
+    int16_t brightness = -1;
+    uint32_t lastUsed = 0;
+    uint8_t levels[256];
+  };
+
+  uint8_t Find(uint8_t brightness)
+  {
+    uint8_t oldest = 0;
+    for (uint8_t i = 0; i < TableCount; i++)
+    {
+      if (_tables[i].brightness == brightness)
+      {
+        return i;
+      }
+      if (_tables[i].lastUsed < _tables[oldest].lastUsed)
+      {
+        oldest = i;
+      }
+    }
+
+    ColorPipeline::BuildLevelTable(brightness, _tables[oldest].levels);
+    _tables[oldest].brightness = brightness;
+    return oldest;
+  }
+
+  Table _tables[TableCount];
+  uint32_t _clock = 0;
+};
+
+// Evaluates the effect of every segment once per frame. All per-pixel math is integer:
+// phases are 16 bit fractions of a cycle and levels are 0-255.
+class EffectEngine
+{
+public:
+  EffectEngine(unsigned int frameRate = LED_STRIP_FRAME_RATE) : _targetFrameRate(frameRate)
+  {
+    _statistics.frameRate = frameRate;
+  }
+
+  // Renders no faster than a frame can leave the wire, frames beyond that would only be dropped.
+  void LimitFrameRate(uint32_t wireMicros)
+  {
+    uint32_t wireMillis = (wireMicros + 999) / 1000;
+    uint32_t wireRate = wireMillis > 0 ? 1000 / wireMillis : _targetFrameRate;
+    _statistics.frameRate = wireRate < _targetFrameRate ? (wireRate > 0 ? wireRate : 1) : _targetFrameRate;
+  }
+
+  TickType_t GetFramePeriod() const
+  {
+    // Rounded up, a tick early would find the output still busy.
+    return pdMS_TO_TICKS((1000 + _statistics.frameRate - 1) / _statistics.frameRate);
+  }
+
+  const RenderStatistics *GetStatistics() const
+  {
+    return &_statistics;
+  }
+
+  // A state arriving while a transition is running retargets it from wherever it currently is.
+  void SetSegmentState(const StripSegmentState &state)
+  {
+    if (state.index >= MaxSegmentCount)
+    {
+      return;
+    }
+
+    SegmentAnimation &animation = _animations[state.index];
+    if (!animation.active)
+    {
+      _activeSegments[_activeCount++] = state.index;
+    }
+    animation.effect = state.effect < EffectCount ? state.effect : EffectSolid;
+    animation.speed = state.speed > 100 ? 100 : state.speed;
+    animation.easing = state.easing < EasingCount ? state.easing : EasingInOut;
+
+    animation.target.hue = (uint32_t)(state.hue % 360) * 65536 / 360;
+    animation.target.saturation = state.saturation >= 100 ? 255 : state.saturation * 255 / 100;
+    animation.target.brightness = state.onOff == 0 ? 0 : state.brightness >= 100 ? 255 : state.brightness * 255 / 100;
+    animation.target.color = ColorPipeline::HueToRgbw(animation.target.hue, animation.target.saturation);
+
+    // The first state of a segment has nothing to fade from.
+    animation.from = animation.active ? animation.current : animation.target;
+    animation.transitionMillis = state.transition > UINT16_MAX ? UINT16_MAX : state.transition;
+    animation.transitionElapsed = 0;
+    animation.active = true;
+    animation.needsRender = true;
+  }
+
+  bool HasSegmentState(unsigned int index) const
+  {
+    return index < MaxSegmentCount && _animations[index].active;
+  }
+
+  // Has the next frame render every segment again, after something else drew over the strip.
+  void Invalidate()
+  {
+    for (uint16_t i = 0; i < _activeCount; i++)
+    {
+      _animations[_activeSegments[i]].needsRender = true;
+    }
+  }
+
+  bool IsAnimating() const
+  {
+    for (uint16_t i = 0; i < _activeCount; i++)
+    {
+      const SegmentAnimation &animation = _animations[_activeSegments[i]];
+      if (animation.active && !animation.empty && (IsTransitioning(animation) || (animation.current.brightness > 0 && animation.effect != EffectSolid)))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Renders one frame, elapsedMillis advances the animations independently of the frame rate.
+  void Render(LedStripDriver *driver, uint32_t elapsedMillis)
+  {
+    for (uint16_t active = 0; active < _activeCount; active++)
+    {
+      uint16_t i = _activeSegments[active];
+      SegmentAnimation &animation = _animations[i];
+      animation.empty = driver->GetSegment(i).length == 0;
+      if (animation.empty)
+      {
+        // Lands on its target right away, a later layout shows it as it is by then.
+        animation.current = animation.target;
+        animation.transitionElapsed = animation.transitionMillis;
+        continue;
+      }
+
+      animation.phase += animation.speed * elapsedMillis / 4;
+      bool transitioning = IsTransitioning(animation);
+      AdvanceTransition(animation, elapsedMillis);
+      const uint8_t *levels = _levelTables.Get(animation.current.brightness, animation.levelTable);
+
+      if (animation.current.brightness == 0 || animation.effect == EffectSolid)
+      {
+        if (animation.needsRender || transitioning)
+        {
+          driver->SetSegmentColor(i, ColorPipeline::Apply(levels, animation.current.color));
+        }
+      }
+      else
+      {
+        RenderEffect(driver, i, animation, levels);
+      }
+      animation.needsRender = false;
+    }
+  }
+
+  // dropped is set when this frame was rendered over one the outputs had not taken yet.
+  void RecordFrame(unsigned long frameMicros, bool dropped)
+  {
+    _statistics.frames++;
+    if (dropped)
+    {
+      _statistics.droppedFrames++;
+    }
+    _statistics.lastFrameMicros = frameMicros;
+    if (frameMicros > _statistics.maxFrameMicros)
+    {
+      _statistics.maxFrameMicros = frameMicros;
+    }
+    if (frameMicros > 1000000UL / _statistics.frameRate)
+    {
+      _statistics.overruns++;
+    }
+  }
+
+protected:
+  static bool IsTransitioning(const SegmentAnimation &animation)
+  {
+    return animation.transitionElapsed < animation.transitionMillis;
+  }
+
+  static void AdvanceTransition(SegmentAnimation &animation, uint32_t elapsedMillis)
+  {
+    if (!IsTransitioning(animation))
+    {
+      animation.current = animation.target;
+      return;
+    }
+
+    uint32_t elapsed = animation.transitionElapsed + elapsedMillis;
+    animation.transitionElapsed = elapsed > animation.transitionMillis ? animation.transitionMillis : elapsed;
+
+    uint32_t progress = ((uint32_t)animation.transitionElapsed << 16) / animation.transitionMillis;
+    uint32_t eased = Ease(animation.easing, progress);
+    const SegmentLook &from = animation.from;
+    const SegmentLook &target = animation.target;
+
+    animation.current.color = RgbwColor(
+        Lerp(from.color.R, target.color.R, eased),
+        Lerp(from.color.G, target.color.G, eased),
+        Lerp(from.color.B, target.color.B, eased),
+        Lerp(from.color.W, target.color.W, eased));
+    // The wrapped 16 bit difference always takes the short way around the wheel.
+    animation.current.hue = from.hue + (((int32_t)(int16_t)(target.hue - from.hue) * (int32_t)eased) >> 16);
+    animation.current.saturation = Lerp(from.saturation, target.saturation, eased);
+    animation.current.brightness = Lerp(from.brightness, target.brightness, eased);
+  }
+
+  // progress and the result are Q16, 65536 being the end of the transition.
+  static uint32_t Ease(uint8_t easing, uint32_t progress)
+  {
+    switch (easing)
+    {
+    case EasingIn:
+      return ((uint64_t)progress * progress) >> 16;
+    case EasingOut:
+    {
+      uint32_t remaining = 65536 - progress;
+      return 65536 - (((uint64_t)remaining * remaining) >> 16);
+    }
+    case EasingInOut:
+    {
+      // Smoothstep, 3p^2 - 2p^3.
+      uint32_t square = ((uint64_t)progress * progress) >> 16;
+      uint32_t cube = (uint32_t)(((uint64_t)square * progress) >> 16);
+      return 3 * square - 2 * cube;
+    }
+    default:
+      return progress;
+    }
+  }
+
+  static uint8_t Lerp(uint8_t from, uint8_t to, uint32_t eased)
+  {
+    return from + (((int32_t)to - from) * (int32_t)eased >> 16);
+  }
+
+  void RenderEffect(LedStripDriver *driver, int segmentIndex, const SegmentAnimation &animation, const uint8_t *levels)
+  {
+    uint16_t length = driver->GetSegment(segmentIndex).length;
+    const SegmentLook &look = animation.current;
+    RgbwColor color = ColorPipeline::Apply(levels, look.color);
+    uint16_t phase = animation.phase;
+    uint16_t baseHue = look.hue;
+
+    switch (animation.effect)
+    {
+    case EffectFade:
+      driver->SetSegmentColor(segmentIndex, ColorPipeline::Apply(levels, ColorPipeline::HueToRgbw(baseHue + phase, look.saturation)));
+      break;
+
+    case EffectRainbow:
+    {
+      uint16_t hueStep = 65536 / length;
+      uint16_t hue = baseHue + phase;
+      for (uint16_t offset = 0; offset < length; offset++, hue += hueStep)
+      {
+        driver->SetSegmentPixelColor(segmentIndex, offset, ColorPipeline::Apply(levels, ColorPipeline::HueToRgbw(hue, look.saturation)));
+      }
+      break;
+    }
+
+    case EffectChase:
+    {
+      // Two lit pixels every six, moving one pixel per 1/64th of a cycle.
+      uint16_t step = phase >> 10;
+      for (uint16_t offset = 0; offset < length; offset++)
+      {
+        driver->SetSegmentPixelColor(segmentIndex, offset, (offset + 6 - step % 6) % 6 < 2 ? color : Zero);
+      }
+      break;
+    }
+
+    case EffectTwinkle:
+    {
+      // Every pixel decays by 1/8th per frame while random ones are relit at full color.
+      for (uint16_t offset = 0; offset < length; offset++)
+      {
+        if ((NextRandom() & 0x3f) == 0)
+        {
+          driver->SetSegmentPixelColor(segmentIndex, offset, color);
+        }
+        else
+        {
+          driver->SetSegmentPixelColor(segmentIndex, offset, ColorPipeline::Scale(driver->GetSegmentPixelColor(segmentIndex, offset), 223));
+        }
+      }
+      break;
+    }
+
+    case EffectBreathe:
+    {
+      // Squared triangle wave, eases in and out without a sine table.
+      uint16_t triangle = phase < 32768 ? phase >> 7 : (65535 - phase) >> 7;
+      uint8_t level = (triangle * triangle) >> 8;
+      driver->SetSegmentColor(segmentIndex, ColorPipeline::Apply(levels, ColorPipeline::Scale(look.color, level)));
+      break;
+    }
+    }
+  }
+
+  uint32_t NextRandom()
+  {
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return _random;
+  }
+
+  SegmentAnimation _animations[MaxSegmentCount];
+  LevelTableCache _levelTables;
+  // Segments that received a state, per-frame work only walks these.
+  uint16_t _activeSegments[MaxSegmentCount];
+  uint16_t _activeCount = 0;
+  unsigned int _targetFrameRate;
+  RenderStatistics _statistics = {};
+  uint32_t _random = 2463534242UL;
+};
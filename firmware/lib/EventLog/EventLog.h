@@ -0,0 +1,255 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+#define EVENT_LOG_LEVEL_NONE 0
+#define EVENT_LOG_LEVEL_ERROR 1
+#define EVENT_LOG_LEVEL_WARN 2
+#define EVENT_LOG_LEVEL_INFO 3
+#define EVENT_LOG_LEVEL_DEBUG 4
+
+// Events above this level are compiled out, e.g. -DEVENT_LOG_LEVEL=EVENT_LOG_LEVEL_WARN
+#ifndef EVENT_LOG_LEVEL
+#define EVENT_LOG_LEVEL EVENT_LOG_LEVEL_INFO
+#endif
+
+// Number of events kept, a power of two. Older events are overwritten.
+#ifndef EVENT_LOG_CAPACITY
+#define EVENT_LOG_CAPACITY 128
+#endif
+
+enum LogEventId
+{
+  LogSegmentNotConfigured,
+  LogSegmentOutputMissing,
+  LogSegmentOverflow,
+  LogPixelCount,
+  LogSegmentOn,
+  LogSegmentOff,
+  LogStripCommand,
+  LogStripConfiguration,
+  LogSettingsInvalid,
+  LogSettingsWritten,
+  LogSettingsGapClamped,
+  LogSceneWriteFailed,
+  LogRealtimeSocketFailed,
+  LogRealtimeStarted,
+  LogRealtimeStopped,
+  LogEventCount
+};
+
+// Formatted only when the events are printed, the arguments are stored as raw 32 bit values.
+static const char *LogEventFormats[LogEventCount] = {
+    "Segment %u is not configured and won't be set.",
+    "Segment %u targets output %u which does not exist.",
+    "Segment %u does not fit in the %u pixels of output %u.",
+    "Total pixel count of all segment within the strip: %u",
+    "Received a On command for segment %u.",
+    "Received a Off command for segment %u.",
+    "StripManager: Received new strip command: Index %u H %u S %u B %u Effect %u",
+    "StripManager: Received new strip configuration: Index %u Length %u",
+    "SettingsStore: No valid settings blob found.",
+    "SettingsStore: Settings written.",
+    "SettingsStore: Gap %u of segment %u cut to %u while migrating.",
+    "SceneStore: Scene %u could not be written, it stays pending.",
+    "RealtimeReceiver: Could not listen on UDP port %u.",
+    "StripManager: Realtime stream took over the strip.",
+    "StripManager: Realtime stream stopped, back to segments.",
+};
+
+static const char *LogLevelNames[] = {"", "E", "W", "I", "D"};
+
+struct LogEvent
+{
+  uint32_t micros;
+  uint16_t id;
+  uint8_t level;
+  uint8_t argumentCount;
+  uint32_t arguments[5];
+};
+
+// Records fixed size binary events into a ring any task can write to without locking; a slot
+// is claimed with one atomic increment. Readers keep their own cursor and detect events that
+// were overwritten while they were behind or while they copied them.
+class EventLog
+{
+public:
+  static const uint32_t Capacity = EVENT_LOG_CAPACITY;
+
+  // Where one reader is in the ring and how many events were overwritten before it got to them.
+  struct Reader
+  {
+    explicit Reader(uint32_t start = 0) : cursor(start)
+    {
+    }
+
+    uint32_t cursor;
+    uint32_t lost = 0;
+  };
+
+  static EventLog &Instance()
+  {
+    static EventLog eventLog;
+    return eventLog;
+  }
+
+  // Starts the task printing new events to the serial port.
+  void Begin()
+  {
+    xTaskCreate(
+        DrainLoop,  /* Task function. */
+        "EventLog", /* String with name of task. */
+        2500,       /* Stack size in words. */
+        this,       /* Parameter passed as input of the task */
+        0,          /* Priority of the task. */
+        NULL);      /* Task handle. */
+  }
+
+  template <typename... T_ARGUMENTS>
+  void Record(uint8_t level, uint16_t id, T_ARGUMENTS... arguments)
+  {
+    static_assert(sizeof...(arguments) <= 5, "Log events carry at most five arguments.");
+
+    uint32_t index = _head.fetch_add(1, std::memory_order_relaxed);
+    Slot &slot = _slots[index & (Capacity - 1)];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.event.micros = micros();
+    slot.event.id = id;
+    slot.event.level = level;
+    slot.event.argumentCount = sizeof...(arguments);
+    uint32_t values[] = {0, (uint32_t)arguments...};
+    memcpy(slot.event.arguments, values + 1, sizeof...(arguments) * sizeof(uint32_t));
+
+    slot.sequence.store(index + 1, std::memory_order_release);
+  }
+
+  // Cursor of the oldest event still held.
+  uint32_t GetOldest() const
+  {
+    uint32_t head = _head.load(std::memory_order_acquire);
+    return head > Capacity ? head - Capacity : 0;
+  }
+
+  // Events overwritten before they reached the serial port.
+  uint32_t GetDropped() const
+  {
+    return _dropped.load(std::memory_order_relaxed);
+  }
+
+  // Copies the event at the cursor of reader and advances it. False when there is nothing new
+  // yet. A cursor that fell behind is moved to the oldest event and the skipped ones are counted
+  // as lost for that reader only.
+  bool Read(Reader &reader, LogEvent &event)
+  {
+    uint32_t &cursor = reader.cursor;
+    while (true)
+    {
+      uint32_t oldest = GetOldest();
+      if (cursor < oldest)
+      {
+        reader.lost += oldest - cursor;
+        cursor = oldest;
+      }
+
+      const Slot &slot = _slots[cursor & (Capacity - 1)];
+      uint32_t before = slot.sequence.load(std::memory_order_acquire);
+      if (before != cursor + 1)
+      {
+        // Either still being written or already overwritten by a later lap.
+        if (before == 0 || before < cursor + 1)
+        {
+          return false;
+        }
+        cursor++;
+        reader.lost++;
+        continue;
+      }
+
+      memcpy(&event, (const void *)&slot.event, sizeof(LogEvent));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.sequence.load(std::memory_order_relaxed) != before)
+      {
+        continue;
+      }
+
+      cursor++;
+      return true;
+    }
+  }
+
+  static size_t Format(const LogEvent &event, char *buffer, size_t size)
+  {
+    if (event.id >= LogEventCount)
+    {
+      return snprintf(buffer, size, "[%10lu] ? unknown event %u", (unsigned long)event.micros, event.id);
+    }
+
+    size_t written = snprintf(buffer, size, "[%10lu] %s ", (unsigned long)event.micros, LogLevelNames[event.level]);
+    if (written < size)
+    {
+      const uint32_t *arguments = event.arguments;
+      written += snprintf(buffer + written, size - written, LogEventFormats[event.id], arguments[0], arguments[1], arguments[2], arguments[3], arguments[4]);
+    }
+    return written < size ? written : size - 1;
+  }
+
+protected:
+  struct Slot
+  {
+    std::atomic<uint32_t> sequence{0};
+    LogEvent event;
+  };
+
+  EventLog()
+  {
+  }
+
+  static void DrainLoop(void *parameter)
+  {
+    EventLog *eventLog = (EventLog *)parameter;
+    Reader reader;
+    LogEvent event;
+    char line[160];
+    while (1)
+    {
+      while (eventLog->Read(reader, event))
+      {
+        Format(event, line, sizeof(line));
+        Serial.println(line);
+      }
+      eventLog->_dropped.store(reader.lost, std::memory_order_relaxed);
+      vTaskDelay(pdMS_TO_TICKS(50));
+    }
+  }
+
+  Slot _slots[Capacity];
+  std::atomic<uint32_t> _head{0};
+  std::atomic<uint32_t> _dropped{0};
+};
+
+#if EVENT_LOG_LEVEL >= EVENT_LOG_LEVEL_ERROR
+#define LOG_ERROR(id, ...) EventLog::Instance().Record(EVENT_LOG_LEVEL_ERROR, id, ##__VA_ARGS__)
+#else
+#define LOG_ERROR(id, ...) ((void)0)
+#endif
+
+#if EVENT_LOG_LEVEL >= EVENT_LOG_LEVEL_WARN
+#define LOG_WARN(id, ...) EventLog::Instance().Record(EVENT_LOG_LEVEL_WARN, id, ##__VA_ARGS__)
+#else
+#define LOG_WARN(id, ...) ((void)0)
+#endif
+
+#if EVENT_LOG_LEVEL >= EVENT_LOG_LEVEL_INFO
+#define LOG_INFO(id, ...) EventLog::Instance().Record(EVENT_LOG_LEVEL_INFO, id, ##__VA_ARGS__)
+#else
+#define LOG_INFO(id, ...) ((void)0)
+#endif
+
+#if EVENT_LOG_LEVEL >= EVENT_LOG_LEVEL_DEBUG
+#define LOG_DEBUG(id, ...) EventLog::Instance().Record(EVENT_LOG_LEVEL_DEBUG, id, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(id, ...) ((void)0)
+#endif
@@ -0,0 +1,178 @@
+#pragma once
+
+// Host stand-in for the parts of the Arduino core used by the firmware.
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "FreeRTOSHost.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+typedef unsigned int uint;
+
+#define PROGMEM
+#define F(string) (string)
+#define FPSTR(string) (string)
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+class String
+{
+public:
+  String() {}
+  String(const char *value) : _value(value != NULL ? value : "") {}
+  String(const std::string &value) : _value(value) {}
+  String(char value) : _value(1, value) {}
+  String(int value) : _value(std::to_string(value)) {}
+  String(unsigned int value) : _value(std::to_string(value)) {}
+  String(long value) : _value(std::to_string(value)) {}
+  String(unsigned long value) : _value(std::to_string(value)) {}
+  String(float value)
+  {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.2f", value);
+    _value = buffer;
+  }
+
+  const char *c_str() const { return _value.c_str(); }
+  unsigned int length() const { return _value.size(); }
+  char charAt(unsigned int index) const { return index < _value.size() ? _value[index] : 0; }
+  explicit operator bool() const { return !_value.empty(); }
+  long toInt() const { return atol(_value.c_str()); }
+  void reserve(unsigned int size) { _value.reserve(size); }
+
+  int indexOf(const char *needle) const
+  {
+    size_t position = _value.find(needle);
+    return position == std::string::npos ? -1 : (int)position;
+  }
+
+  void replace(const char *find, const String &replacement)
+  {
+    size_t findLength = strlen(find);
+    size_t position = 0;
+    while (findLength > 0 && (position = _value.find(find, position)) != std::string::npos)
+    {
+      _value.replace(position, findLength, replacement._value);
+      position += replacement._value.size();
+    }
+  }
+
+  String &operator+=(const String &other)
+  {
+    _value += other._value;
+    return *this;
+  }
+
+  friend String operator+(const String &left, const String &right) { return String(left._value + right._value); }
+  friend String operator+(const String &left, const char *right) { return String(left._value + right); }
+  friend String operator+(const char *left, const String &right) { return String(left + right._value); }
+  bool operator==(const String &other) const { return _value == other._value; }
+  bool operator==(const char *other) const { return _value == other; }
+  bool operator!=(const String &other) const { return _value != other._value; }
+  bool operator!=(const char *other) const { return _value != other; }
+
+private:
+  std::string _value;
+};
+
+// An IPv4 address, stored in network order like on the device.
+class IPAddress
+{
+public:
+  IPAddress() {}
+  IPAddress(uint32_t address) : _address(address) {}
+  IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth)
+      : _address(first | (second << 8) | (third << 16) | ((uint32_t)fourth << 24)) {}
+
+  operator uint32_t() const { return _address; }
+
+  String toString() const
+  {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", _address & 0xff, (_address >> 8) & 0xff, (_address >> 16) & 0xff, _address >> 24);
+    return String(text);
+  }
+
+private:
+  uint32_t _address = 0;
+};
+
+class HostSerial
+{
+public:
+  void begin(unsigned long) {}
+
+  // Lets host programs silence the firmware's console output.
+  void setMuted(bool muted) { _muted = muted; }
+
+  void print(const String &value)
+  {
+    if (!_muted)
+      fputs(value.c_str(), stdout);
+  }
+
+  void println(const String &value)
+  {
+    if (!_muted)
+      puts(value.c_str());
+  }
+
+  void println()
+  {
+    println("");
+  }
+
+  size_t write(const uint8_t *data, size_t size)
+  {
+    return _muted ? size : fwrite(data, 1, size, stdout);
+  }
+
+  int printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+  {
+    if (_muted)
+      return 0;
+
+    va_list arguments;
+    va_start(arguments, format);
+    int written = vprintf(format, arguments);
+    va_end(arguments);
+    return written;
+  }
+
+private:
+  bool _muted = false;
+};
+
+inline HostSerial Serial;
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) {}
+inline void yield() { std::this_thread::yield(); }
+
+// Chip queries of the Arduino core, answered like an ESP32 with 4 MB of flash.
+#define SPI_FLASH_SEC_SIZE 4096
+
+class EspClass
+{
+public:
+  uint64_t getEfuseMac() { return 0x78563412cfa4ULL; }
+  uint32_t getFlashChipSize() { return 4 * 1024 * 1024; }
+  uint32_t getFlashChipSpeed() { return 40000000; }
+  uint32_t getFlashChipMode() { return 2; }
+  uint32_t getFreeHeap() { return 200 * 1024; }
+  uint32_t getCpuFreqMHz() { return 240; }
+  const char *getSdkVersion() { return "host"; }
+  bool flashEraseSector(uint32_t sector) { return true; }
+
+  // The process ends where the chip would reset.
+  void restart() { exit(0); }
+};
+
+inline EspClass ESP;
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Host stand-in for the captive portal DNS server, no request ever arrives.
+enum class DNSReplyCode
+{
+  NoError = 0,
+  FormError = 1,
+  ServerFailure = 2,
+  NonExistentDomain = 3,
+  NotImplemented = 4,
+  Refused = 5,
+};
+
+class DNSServer
+{
+public:
+  void setErrorReplyCode(const DNSReplyCode &replyCode) {}
+  bool start(const uint16_t &port, const String &domainName, const IPAddress &resolvedIP) { return true; }
+  void processNextRequest() {}
+  void stop() {}
+};
@@ -0,0 +1,558 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Host stand-in for ESPAsyncWebServer. Routes are registered as on the device and host programs
+// feed requests through AsyncWebServer::Dispatch() instead of a socket.
+
+typedef enum
+{
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111,
+} WebRequestMethod;
+
+typedef uint8_t WebRequestMethodComposite;
+
+class AsyncWebParameter
+{
+public:
+  AsyncWebParameter(const String &name, const String &value) : _name(name), _value(value) {}
+
+  const String &name() const { return _name; }
+  const String &value() const { return _value; }
+
+private:
+  String _name;
+  String _value;
+};
+
+// The connection of a request, host programs choose the address a request comes from.
+class AsyncClient
+{
+public:
+  IPAddress remoteIP() const { return _remoteIP; }
+  void SetRemoteIP(const IPAddress &address) { _remoteIP = address; }
+
+private:
+  IPAddress _remoteIP = IPAddress(127, 0, 0, 1);
+};
+
+class AsyncWebServerResponse
+{
+public:
+  AsyncWebServerResponse(int code, const String &content) : _code(code), _content(content) {}
+
+  void addHeader(const String &name, const String &value)
+  {
+    _headers.push_back(std::make_pair(name, value));
+  }
+
+  virtual ~AsyncWebServerResponse() {}
+
+  int code() const { return _code; }
+  const String &content() const { return _content; }
+
+  const String *GetHeader(const char *name) const
+  {
+    for (const auto &header : _headers)
+    {
+      if (header.first == name)
+        return &header.second;
+    }
+    return NULL;
+  }
+
+protected:
+  int _code;
+  String _content;
+  std::vector<std::pair<String, String>> _headers;
+};
+
+// Copies what is written into the response, the content outlives the handler.
+class AsyncResponseStream : public AsyncWebServerResponse
+{
+public:
+  AsyncResponseStream(const String &contentType, size_t bufferSize) : AsyncWebServerResponse(200, String()) {}
+
+  size_t write(const uint8_t *data, size_t length)
+  {
+    _content += String(std::string((const char *)data, length));
+    return length;
+  }
+};
+
+typedef std::function<void(void)> ArDisconnectHandler;
+
+class AsyncWebServerRequest
+{
+public:
+  // A request with a body is a POST, the body is not copied and has to outlive the request.
+  AsyncWebServerRequest(const char *url, const uint8_t *body = NULL, size_t bodyLength = 0)
+      : _method(body != NULL ? HTTP_POST : HTTP_GET), _body(body), _bodyLength(bodyLength)
+  {
+    const char *query = strchr(url, '?');
+    _url = query != NULL ? String(std::string(url, query - url)) : String(url);
+    while (query != NULL)
+    {
+      const char *name = query + 1;
+      query = strchr(name, '&');
+      const char *end = query != NULL ? query : name + strlen(name);
+      const char *equals = (const char *)memchr(name, '=', end - name);
+      const char *valueStart = equals != NULL ? equals + 1 : end;
+      _params.push_back(AsyncWebParameter(String(std::string(name, (equals != NULL ? equals : end) - name)), String(std::string(valueStart, end - valueStart))));
+    }
+  }
+
+  const String &url() const { return _url; }
+  WebRequestMethodComposite method() const { return _method; }
+  size_t contentLength() const { return _bodyLength; }
+  const uint8_t *body() const { return _body; }
+  AsyncClient *client() { return &_client; }
+
+  ~AsyncWebServerRequest()
+  {
+    if (_onDisconnect)
+    {
+      _onDisconnect();
+    }
+  }
+
+  // Runs once the client is gone. A host program reusing the request for the next exchange ends
+  // the previous one here.
+  void onDisconnect(ArDisconnectHandler handler)
+  {
+    if (_onDisconnect)
+    {
+      _onDisconnect();
+    }
+    _onDisconnect = handler;
+  }
+
+  bool hasParam(const char *name) const
+  {
+    for (const AsyncWebParameter &param : _params)
+    {
+      if (param.name() == name)
+        return true;
+    }
+    return false;
+  }
+
+  size_t params() const { return _params.size(); }
+
+  AsyncWebParameter *getParam(size_t index)
+  {
+    return index < _params.size() ? &_params[index] : NULL;
+  }
+
+  AsyncWebParameter *getParam(const char *name)
+  {
+    for (AsyncWebParameter &param : _params)
+    {
+      if (param.name() == name)
+        return &param;
+    }
+    return NULL;
+  }
+
+  void send(int code)
+  {
+    _code = code;
+    _content = String();
+    _contentData = NULL;
+  }
+
+  void send(int code, const String &contentType, const String &content)
+  {
+    _code = code;
+    _content = content;
+    _contentData = NULL;
+  }
+
+  AsyncWebServerResponse *beginResponse(int code, const String &contentType = String(), const String &content = String())
+  {
+    return new AsyncWebServerResponse(code, content);
+  }
+
+  AsyncResponseStream *beginResponseStream(const String &contentType, size_t bufferSize = 1460)
+  {
+    return new AsyncResponseStream(contentType, bufferSize);
+  }
+
+  // Keeps the headers of the response for host programs to check.
+  void send(AsyncWebServerResponse *response)
+  {
+    _code = response->code();
+    _content = response->content();
+    _contentData = NULL;
+    _response.reset(response);
+  }
+
+  // The content is read when the response goes out, it is not copied until a host program asks
+  // for it.
+  void send_P(int code, const String &contentType, const uint8_t *content, size_t len)
+  {
+    _code = code;
+    _contentData = content;
+    _contentLength = len;
+  }
+
+  void send_P(int code, const String &contentType, const char *content)
+  {
+    send_P(code, contentType, (const uint8_t *)content, strlen(content));
+  }
+
+  int responseCode() const { return _code; }
+  String responseContent() const
+  {
+    return _contentData != NULL ? String(std::string((const char *)_contentData, _contentLength)) : _content;
+  }
+
+  const String *responseHeader(const char *name) const
+  {
+    return _response ? _response->GetHeader(name) : NULL;
+  }
+
+private:
+  String _url;
+  WebRequestMethodComposite _method;
+  const uint8_t *_body;
+  size_t _bodyLength;
+  std::vector<AsyncWebParameter> _params;
+  AsyncClient _client;
+  int _code = 0;
+  String _content;
+  const uint8_t *_contentData = NULL;
+  size_t _contentLength = 0;
+  std::shared_ptr<AsyncWebServerResponse> _response;
+  ArDisconnectHandler _onDisconnect;
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final)> ArUploadHandlerFunction;
+typedef std::function<void(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)> ArBodyHandlerFunction;
+
+class AsyncWebHandler
+{
+public:
+  virtual ~AsyncWebHandler() {}
+};
+
+typedef enum
+{
+  WS_EVT_CONNECT,
+  WS_EVT_DISCONNECT,
+  WS_EVT_PONG,
+  WS_EVT_ERROR,
+  WS_EVT_DATA
+} AwsEventType;
+
+#define WS_CONTINUATION 0x00
+#define WS_TEXT 0x01
+#define WS_BINARY 0x02
+
+typedef struct
+{
+  uint8_t message_opcode;
+  uint32_t num;
+  uint8_t final;
+  uint8_t masked;
+  uint8_t opcode;
+  uint64_t len;
+  uint8_t mask[4];
+  uint64_t index;
+} AwsFrameInfo;
+
+class AsyncWebSocket;
+
+// Keeps what the controller sent, host programs take it with TakeMessages().
+class AsyncWebSocketClient
+{
+public:
+  AsyncWebSocketClient(AsyncWebSocket *server, uint32_t id) : _server(server), _id(id) {}
+
+  uint32_t id() const { return _id; }
+  AsyncWebSocket *server() { return _server; }
+  IPAddress remoteIP() const { return IPAddress(127, 0, 0, 1); }
+  bool canSend() const { return true; }
+
+  void binary(const uint8_t *data, size_t len)
+  {
+    _messages.push_back(std::vector<uint8_t>(data, data + len));
+  }
+
+  void text(const char *message)
+  {
+    binary((const uint8_t *)message, strlen(message));
+  }
+
+  void close()
+  {
+    _closed = true;
+  }
+
+  bool IsClosed() const { return _closed; }
+
+  std::vector<std::vector<uint8_t>> TakeMessages()
+  {
+    std::vector<std::vector<uint8_t>> messages;
+    messages.swap(_messages);
+    return messages;
+  }
+
+private:
+  AsyncWebSocket *_server;
+  uint32_t _id;
+  bool _closed = false;
+  std::vector<std::vector<uint8_t>> _messages;
+};
+
+typedef std::function<void(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)> AwsEventHandler;
+
+// Host programs connect clients and deliver messages to them as single, unfragmented frames.
+class AsyncWebSocket : public AsyncWebHandler
+{
+public:
+  AsyncWebSocket(const String &url) : _url(url) {}
+
+  const String &url() const { return _url; }
+
+  void onEvent(AwsEventHandler handler)
+  {
+    _handler = handler;
+  }
+
+  size_t count() const
+  {
+    return _clients.size();
+  }
+
+  void cleanupClients(uint16_t maxClients = 8)
+  {
+  }
+
+  void binaryAll(const uint8_t *data, size_t len)
+  {
+    for (auto &client : _clients)
+    {
+      client->binary(data, len);
+    }
+  }
+
+  AsyncWebSocketClient *Connect()
+  {
+    _clients.emplace_back(new AsyncWebSocketClient(this, ++_lastId));
+    AsyncWebSocketClient *client = _clients.back().get();
+    _handler(this, client, WS_EVT_CONNECT, NULL, NULL, 0);
+    return client;
+  }
+
+  void Receive(AsyncWebSocketClient *client, const uint8_t *data, size_t len)
+  {
+    AwsFrameInfo info = {};
+    info.message_opcode = WS_BINARY;
+    info.final = 1;
+    info.opcode = WS_BINARY;
+    info.len = len;
+    _handler(this, client, WS_EVT_DATA, &info, (uint8_t *)data, len);
+  }
+
+  void Disconnect(AsyncWebSocketClient *client)
+  {
+    _handler(this, client, WS_EVT_DISCONNECT, NULL, NULL, 0);
+    for (auto entry = _clients.begin(); entry != _clients.end(); entry++)
+    {
+      if (entry->get() == client)
+      {
+        _clients.erase(entry);
+        return;
+      }
+    }
+  }
+
+private:
+  String _url;
+  AwsEventHandler _handler;
+  uint32_t _lastId = 0;
+  std::vector<std::unique_ptr<AsyncWebSocketClient>> _clients;
+};
+
+class AsyncEventSource;
+
+struct HostEvent
+{
+  std::string event;
+  uint32_t id;
+  std::string data;
+};
+
+// Keeps the events sent to it, host programs take them with TakeEvents(). Events are sent from
+// other tasks than the one taking them.
+class AsyncEventSourceClient
+{
+public:
+  AsyncEventSourceClient(AsyncEventSource *server, uint32_t lastId) : _server(server), _lastId(lastId) {}
+
+  AsyncEventSource *server() { return _server; }
+  uint32_t lastId() const { return _lastId; }
+  bool connected() const { return _connected; }
+  void close() { _connected = false; }
+
+  void send(const char *message, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _events.push_back(HostEvent{event != NULL ? event : "", id, message});
+  }
+
+  std::vector<HostEvent> TakeEvents()
+  {
+    std::vector<HostEvent> events;
+    std::lock_guard<std::mutex> lock(_lock);
+    events.swap(_events);
+    return events;
+  }
+
+private:
+  AsyncEventSource *_server;
+  uint32_t _lastId;
+  std::atomic<bool> _connected{true};
+  std::mutex _lock;
+  std::vector<HostEvent> _events;
+};
+
+typedef std::function<void(AsyncEventSourceClient *client)> ArEventHandlerFunction;
+
+// Host programs connect clients with the Last-Event-ID they resume from, 0 for none. The client
+// list is locked like in the library build the firmware uses, any task may send.
+class AsyncEventSource : public AsyncWebHandler
+{
+public:
+  AsyncEventSource(const String &url) : _url(url) {}
+
+  const String &url() const { return _url; }
+
+  void onConnect(ArEventHandlerFunction handler)
+  {
+    _handler = handler;
+  }
+
+  size_t count() const
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _clients.size();
+  }
+
+  void send(const char *message, const char *event = NULL, uint32_t id = 0, uint32_t reconnect = 0)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto &client : _clients)
+    {
+      client->send(message, event, id, reconnect);
+    }
+  }
+
+  AsyncEventSourceClient *Connect(uint32_t lastId = 0)
+  {
+    AsyncEventSourceClient *client = new AsyncEventSourceClient(this, lastId);
+    if (_handler)
+    {
+      _handler(client);
+    }
+    std::lock_guard<std::mutex> lock(_lock);
+    _clients.emplace_back(client);
+    return client;
+  }
+
+  void Disconnect(AsyncEventSourceClient *client)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto entry = _clients.begin(); entry != _clients.end(); entry++)
+    {
+      if (entry->get() == client)
+      {
+        _clients.erase(entry);
+        return;
+      }
+    }
+  }
+
+private:
+  String _url;
+  ArEventHandlerFunction _handler;
+  mutable std::mutex _lock;
+  std::vector<std::unique_ptr<AsyncEventSourceClient>> _clients;
+};
+
+class AsyncWebServer
+{
+public:
+  AsyncWebServer(uint16_t port) {}
+
+  void on(const char *uri, ArRequestHandlerFunction onRequest)
+  {
+    on(uri, HTTP_ANY, onRequest);
+  }
+
+  void on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction onRequest,
+          ArUploadHandlerFunction onUpload = nullptr, ArBodyHandlerFunction onBody = nullptr)
+  {
+    _routes.push_back(Route{uri, method, onRequest, onBody});
+  }
+
+  AsyncWebHandler &addHandler(AsyncWebHandler *handler)
+  {
+    return *handler;
+  }
+
+  void begin()
+  {
+  }
+
+  // Runs the handler registered for the path and method of the request, 404 when there is none.
+  // A body is handed to the body handler in chunks of one TCP segment first.
+  void Dispatch(AsyncWebServerRequest &request)
+  {
+    for (const Route &route : _routes)
+    {
+      if (request.url() == route.uri.c_str() && (request.method() & route.method) != 0)
+      {
+        if (route.onBody && request.contentLength() > 0)
+        {
+          for (size_t index = 0; index < request.contentLength(); index += BodyChunkSize)
+          {
+            size_t length = std::min(BodyChunkSize, request.contentLength() - index);
+            route.onBody(&request, (uint8_t *)request.body() + index, length, index, request.contentLength());
+          }
+        }
+        route.onRequest(&request);
+        return;
+      }
+    }
+    request.send(404);
+  }
+
+private:
+  static constexpr size_t BodyChunkSize = 1436;
+
+  struct Route
+  {
+    std::string uri;
+    WebRequestMethodComposite method;
+    ArRequestHandlerFunction onRequest;
+    ArBodyHandlerFunction onBody;
+  };
+
+  std::vector<Route> _routes;
+};
@@ -0,0 +1,428 @@
+#pragma once
+
+// Host emulation of the subset of FreeRTOS used by the firmware. Tasks are threads and
+// every kernel object shares one lock, timing follows the host clock with 1 ms ticks.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xffffffffUL
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configTICK_RATE_HZ 1000
+#define tskNO_AFFINITY 0x7fffffff
+
+inline std::chrono::steady_clock::time_point HostEpoch()
+{
+  static const auto epoch = std::chrono::steady_clock::now();
+  return epoch;
+}
+inline int64_t esp_timer_get_time()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - HostEpoch()).count();
+}
+inline unsigned long micros() { return (unsigned long)esp_timer_get_time(); }
+inline unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+inline void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+inline void delayMicroseconds(uint32_t us) { std::this_thread::sleep_for(std::chrono::microseconds(us)); }
+inline TickType_t xTaskGetTickCount() { return (TickType_t)millis(); }
+inline void vTaskDelay(TickType_t ticks) { delay(ticks); }
+inline void vTaskDelayUntil(TickType_t *previous, TickType_t increment)
+{
+  *previous += increment;
+  int32_t remaining = (int32_t)(*previous - xTaskGetTickCount());
+  if (remaining > 0)
+    delay(remaining);
+}
+
+// Critical sections map onto a single process-wide lock.
+struct portMUX_TYPE
+{
+  std::recursive_mutex mutex;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(mux) (mux)->mutex.lock()
+#define portEXIT_CRITICAL(mux) (mux)->mutex.unlock()
+#define portENTER_CRITICAL_ISR(mux) (mux)->mutex.lock()
+#define portEXIT_CRITICAL_ISR(mux) (mux)->mutex.unlock()
+
+inline std::mutex &HostKernelLock()
+{
+  // Never destroyed, detached task threads may still be waiting on it at exit.
+  static std::mutex *lock = new std::mutex();
+  return *lock;
+}
+inline std::condition_variable &HostKernelSignal()
+{
+  static std::condition_variable *signal = new std::condition_variable();
+  return *signal;
+}
+
+template <typename TPredicate>
+inline bool HostWait(std::unique_lock<std::mutex> &lock, TickType_t ticks, TPredicate predicate)
+{
+  if (ticks == portMAX_DELAY)
+  {
+    HostKernelSignal().wait(lock, predicate);
+    return true;
+  }
+  if (ticks == 0)
+  {
+    return predicate();
+  }
+  return HostKernelSignal().wait_for(lock, std::chrono::milliseconds(ticks), predicate);
+}
+
+struct HostQueueSet;
+
+// Items are copied into storage allocated with the queue, like FreeRTOS, so sending and
+// receiving never touch the heap.
+struct HostQueue
+{
+  size_t itemSize;
+  size_t depth;
+  std::vector<uint8_t> storage;
+  size_t head = 0;
+  size_t count = 0;
+  HostQueueSet *set = nullptr;
+};
+typedef HostQueue *QueueHandle_t;
+typedef HostQueue *SemaphoreHandle_t;
+typedef HostQueue *QueueSetMemberHandle_t;
+
+struct HostQueueSet
+{
+  std::vector<HostQueue *> ready;
+};
+typedef HostQueueSet *QueueSetHandle_t;
+
+inline QueueHandle_t xQueueCreate(UBaseType_t depth, UBaseType_t itemSize)
+{
+  HostQueue *queue = new HostQueue();
+  queue->itemSize = itemSize;
+  queue->depth = depth;
+  queue->storage.resize(depth * itemSize);
+  return queue;
+}
+
+inline void HostQueuePush(QueueHandle_t queue, const void *item, bool overwrite)
+{
+  // Overwriting a waiting item does not announce the queue to its set a second time.
+  bool announce = !(overwrite && queue->count > 0);
+  if (overwrite && queue->count > 0)
+    queue->count--;
+  if (item && queue->itemSize > 0)
+    memcpy(queue->storage.data() + (queue->head + queue->count) % queue->depth * queue->itemSize, item, queue->itemSize);
+  queue->count++;
+  if (queue->set && announce)
+    queue->set->ready.push_back(queue);
+  HostKernelSignal().notify_all();
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  if (!HostWait(lock, ticks, [&] { return queue->count < queue->depth; }))
+    return pdFALSE;
+  HostQueuePush(queue, item, false);
+  return pdTRUE;
+}
+#define xQueueSendToBack xQueueSend
+
+inline BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  HostQueuePush(queue, item, true);
+  return pdTRUE;
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  if (!HostWait(lock, ticks, [&] { return queue->count > 0; }))
+    return pdFALSE;
+  if (item && queue->itemSize > 0)
+    memcpy(item, queue->storage.data() + queue->head * queue->itemSize, queue->itemSize);
+  queue->head = (queue->head + 1) % queue->depth;
+  queue->count--;
+  if (queue->set)
+  {
+    auto &ready = queue->set->ready;
+    auto found = std::find(ready.begin(), ready.end(), queue);
+    if (found != ready.end())
+      ready.erase(found);
+  }
+  HostKernelSignal().notify_all();
+  return pdTRUE;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  return queue->count;
+}
+
+inline UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  return queue->depth - queue->count;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return xQueueCreate(1, 0); }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  if (semaphore->count > 0)
+    return pdFALSE;
+  HostQueuePush(semaphore, nullptr, false);
+  return pdTRUE;
+}
+// No priority inheritance on the host, a mutex is a binary semaphore that starts out given.
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  SemaphoreHandle_t mutex = xSemaphoreCreateBinary();
+  xSemaphoreGive(mutex);
+  return mutex;
+}
+inline BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *)
+{
+  return xSemaphoreGive(semaphore);
+}
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+  return xQueueReceive(semaphore, nullptr, ticks);
+}
+
+inline QueueSetHandle_t xQueueCreateSet(UBaseType_t length)
+{
+  HostQueueSet *set = new HostQueueSet();
+  set->ready.reserve(length);
+  return set;
+}
+inline BaseType_t xQueueAddToSet(QueueSetMemberHandle_t member, QueueSetHandle_t set)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  member->set = set;
+  return pdPASS;
+}
+inline QueueSetMemberHandle_t xQueueSelectFromSet(QueueSetHandle_t set, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  if (!HostWait(lock, ticks, [&] { return !set->ready.empty(); }))
+    return nullptr;
+  return set->ready.front();
+}
+
+// Tasks run as detached threads; notifications use the kernel lock.
+struct HostTask
+{
+  uint32_t notification = 0;
+  bool pending = false;
+};
+typedef HostTask *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+inline HostTask *&HostCurrentTask()
+{
+  thread_local HostTask *current = nullptr;
+  if (!current)
+    current = new HostTask();
+  return current;
+}
+
+// Thrown by vTaskDelete() to unwind the thread of the task.
+struct HostTaskDeleted
+{
+};
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *, uint32_t, void *parameter, UBaseType_t, TaskHandle_t *handle, BaseType_t)
+{
+  HostTask *task = new HostTask();
+  if (handle)
+    *handle = task;
+  std::thread([=] {
+    HostCurrentTask() = task;
+    try
+    {
+      function(parameter);
+    }
+    catch (const HostTaskDeleted &)
+    {
+    }
+  }).detach();
+  return pdPASS;
+}
+inline BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *parameter, UBaseType_t priority, TaskHandle_t *handle)
+{
+  return xTaskCreatePinnedToCore(function, name, stack, parameter, priority, handle, tskNO_AFFINITY);
+}
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return HostCurrentTask(); }
+
+// Only a task deleting itself is supported.
+inline void vTaskDelete(TaskHandle_t task)
+{
+  if (task == nullptr || task == HostCurrentTask())
+  {
+    throw HostTaskDeleted();
+  }
+}
+
+enum eNotifyAction
+{
+  eNoAction,
+  eSetBits,
+  eIncrement,
+  eSetValueWithOverwrite
+};
+
+inline BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  switch (action)
+  {
+  case eSetBits:
+    task->notification |= value;
+    break;
+  case eIncrement:
+    task->notification++;
+    break;
+  case eSetValueWithOverwrite:
+    task->notification = value;
+    break;
+  default:
+    break;
+  }
+  task->pending = true;
+  HostKernelSignal().notify_all();
+  return pdPASS;
+}
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task) { return xTaskNotify(task, 0, eIncrement); }
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *) { xTaskNotifyGive(task); }
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+  HostTask *task = HostCurrentTask();
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  HostWait(lock, ticks, [&] { return task->notification != 0; });
+  uint32_t value = task->notification;
+  if (value)
+    task->notification = clearOnExit ? 0 : value - 1;
+  task->pending = false;
+  return value;
+}
+
+inline BaseType_t xTaskNotifyWait(uint32_t clearOnEntry, uint32_t clearOnExit, uint32_t *value, TickType_t ticks)
+{
+  HostTask *task = HostCurrentTask();
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  if (!task->pending)
+    task->notification &= ~clearOnEntry;
+  if (!HostWait(lock, ticks, [&] { return task->pending; }))
+    return pdFALSE;
+  if (value)
+    *value = task->notification;
+  task->notification &= ~clearOnExit;
+  task->pending = false;
+  return pdTRUE;
+}
+
+// Software timers share one daemon thread that runs the callbacks, like the FreeRTOS timer task.
+struct HostTimer;
+typedef HostTimer *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+struct HostTimer
+{
+  TickType_t period;
+  bool autoReload;
+  void *id;
+  TimerCallbackFunction_t callback;
+  bool active = false;
+  TickType_t expiry = 0;
+};
+
+inline std::vector<HostTimer *> &HostTimers()
+{
+  static std::vector<HostTimer *> *timers = new std::vector<HostTimer *>();
+  return *timers;
+}
+
+inline void HostTimerDaemon()
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  while (true)
+  {
+    HostTimer *next = nullptr;
+    for (HostTimer *timer : HostTimers())
+    {
+      if (timer->active && (!next || (int32_t)(timer->expiry - next->expiry) < 0))
+        next = timer;
+    }
+    if (!next)
+    {
+      HostKernelSignal().wait(lock);
+      continue;
+    }
+
+    int32_t remaining = (int32_t)(next->expiry - xTaskGetTickCount());
+    if (remaining > 0)
+    {
+      HostKernelSignal().wait_for(lock, std::chrono::milliseconds(remaining));
+      continue;
+    }
+
+    if (next->autoReload)
+      next->expiry += next->period;
+    else
+      next->active = false;
+    lock.unlock();
+    next->callback(next);
+    lock.lock();
+  }
+}
+
+inline TimerHandle_t xTimerCreate(const char *, TickType_t period, UBaseType_t autoReload, void *id, TimerCallbackFunction_t callback)
+{
+  static std::once_flag daemonStarted;
+  std::call_once(daemonStarted, [] { std::thread(HostTimerDaemon).detach(); });
+
+  HostTimer *timer = new HostTimer{period, autoReload != pdFALSE, id, callback};
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  HostTimers().push_back(timer);
+  return timer;
+}
+inline BaseType_t xTimerStart(TimerHandle_t timer, TickType_t)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  timer->active = true;
+  timer->expiry = xTaskGetTickCount() + timer->period;
+  HostKernelSignal().notify_all();
+  return pdPASS;
+}
+inline BaseType_t xTimerStop(TimerHandle_t timer, TickType_t)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  timer->active = false;
+  HostKernelSignal().notify_all();
+  return pdPASS;
+}
+inline BaseType_t xTimerIsTimerActive(TimerHandle_t timer)
+{
+  std::unique_lock<std::mutex> lock(HostKernelLock());
+  return timer->active ? pdTRUE : pdFALSE;
+}
+inline void *pvTimerGetTimerID(TimerHandle_t timer) { return timer->id; }
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+// Host stand-in for NeoPixelBus: the color types used by the firmware and a bus that records
+// every committed frame on a SimulatedWire instead of driving a pin.
+
+struct HtmlColor
+{
+  HtmlColor(uint32_t color) : Color(color) {}
+  uint32_t Color;
+};
+
+struct RgbColor
+{
+  RgbColor(uint8_t red, uint8_t green, uint8_t blue) : R(red), G(green), B(blue) {}
+  RgbColor(uint8_t brightness = 0) : R(brightness), G(brightness), B(brightness) {}
+  RgbColor(const HtmlColor &color) : R(color.Color >> 16), G(color.Color >> 8), B(color.Color) {}
+
+  uint8_t R;
+  uint8_t G;
+  uint8_t B;
+};
+
+struct RgbwColor
+{
+  RgbwColor(uint8_t red, uint8_t green, uint8_t blue, uint8_t white = 0) : R(red), G(green), B(blue), W(white) {}
+  RgbwColor(uint8_t brightness = 0) : R(0), G(0), B(0), W(brightness) {}
+  RgbwColor(const RgbColor &color) : R(color.R), G(color.G), B(color.B), W(0) {}
+  RgbwColor(const HtmlColor &color) : R(color.Color >> 16), G(color.Color >> 8), B(color.Color), W(color.Color >> 24) {}
+
+  bool operator==(const RgbwColor &other) const { return R == other.R && G == other.G && B == other.B && W == other.W; }
+  bool operator!=(const RgbwColor &other) const { return !(*this == other); }
+
+  uint8_t R;
+  uint8_t G;
+  uint8_t B;
+  uint8_t W;
+};
+
+template <typename T_COLOR_OBJECT, size_t T_PIXEL_SIZE, size_t R, size_t G, size_t B, int W>
+struct HostColorFeature
+{
+  static const size_t PixelSize = T_PIXEL_SIZE;
+  typedef T_COLOR_OBJECT ColorObject;
+
+  static void applyPixelColor(uint8_t *pixels, uint16_t index, const RgbwColor &color)
+  {
+    uint8_t *pixel = pixels + index * PixelSize;
+    pixel[R] = color.R;
+    pixel[G] = color.G;
+    pixel[B] = color.B;
+    if (W >= 0)
+      pixel[W] = color.W;
+  }
+
+  static RgbwColor retrievePixelColor(const uint8_t *pixels, uint16_t index)
+  {
+    const uint8_t *pixel = pixels + index * PixelSize;
+    return RgbwColor(pixel[R], pixel[G], pixel[B], W >= 0 ? pixel[W] : 0);
+  }
+};
+
+typedef HostColorFeature<RgbwColor, 4, 1, 0, 2, 3> NeoGrbwFeature;
+typedef HostColorFeature<RgbwColor, 4, 0, 1, 2, 3> NeoRgbwFeature;
+typedef HostColorFeature<RgbColor, 3, 1, 0, 2, -1> NeoGrbFeature;
+typedef HostColorFeature<RgbColor, 3, 0, 1, 2, -1> NeoRgbFeature;
+
+// WS2812 timing: 1.25 us per bit and the latch time the ESP32 RMT methods wait after a frame.
+struct SimulatedWireTiming
+{
+  uint32_t bitNanos = 1250;
+  uint32_t resetMicros = 300;
+};
+
+struct SimulatedFrame
+{
+  uint8_t pin;
+  int64_t startMicros;
+  int64_t latchedMicros;
+  std::vector<uint8_t> bytes;
+};
+
+// Every bus of the process reports here, frames are kept until a host program drains them.
+class SimulatedWire
+{
+public:
+  static SimulatedWireTiming &Timing()
+  {
+    static SimulatedWireTiming timing;
+    return timing;
+  }
+
+  static uint32_t WireMicros(size_t byteCount)
+  {
+    return (uint64_t)byteCount * 8 * Timing().bitNanos / 1000 + Timing().resetMicros;
+  }
+
+  static void Record(SimulatedFrame frame)
+  {
+    std::unique_lock<std::mutex> lock(Lock());
+    Frames().push_back(std::move(frame));
+  }
+
+  static std::vector<SimulatedFrame> TakeFrames()
+  {
+    std::unique_lock<std::mutex> lock(Lock());
+    std::vector<SimulatedFrame> frames;
+    frames.swap(Frames());
+    return frames;
+  }
+
+  // Frames are only kept while recording is on, long runs can leave it off and count instead.
+  static bool &Recording()
+  {
+    static bool recording = true;
+    return recording;
+  }
+
+private:
+  static std::mutex &Lock()
+  {
+    static std::mutex *lock = new std::mutex();
+    return *lock;
+  }
+
+  static std::vector<SimulatedFrame> &Frames()
+  {
+    static std::vector<SimulatedFrame> *frames = new std::vector<SimulatedFrame>();
+    return *frames;
+  }
+};
+
+class Neo800KbpsMethod
+{
+};
+
+template <typename T_COLOR_FEATURE, typename T_METHOD>
+class NeoPixelBus
+{
+public:
+  NeoPixelBus(uint16_t pixelCount, uint8_t pin) : _pixelCount(pixelCount), _pin(pin), _pixels(pixelCount * T_COLOR_FEATURE::PixelSize)
+  {
+  }
+
+  void Begin()
+  {
+  }
+
+  // Like the RMT methods: waits for the previous frame to leave the wire, then starts this one
+  // and returns right away.
+  void Show(bool maintainBufferConsistency = true)
+  {
+    int64_t now = esp_timer_get_time();
+    if (now < _busyUntilMicros)
+    {
+      delayMicroseconds(_busyUntilMicros - now);
+      now = esp_timer_get_time();
+    }
+
+    _busyUntilMicros = now + SimulatedWire::WireMicros(_pixels.size());
+    _frames++;
+    if (SimulatedWire::Recording())
+    {
+      SimulatedWire::Record(SimulatedFrame{_pin, now, _busyUntilMicros, _pixels});
+    }
+    _dirty = false;
+  }
+
+  bool CanShow() const
+  {
+    return esp_timer_get_time() >= _busyUntilMicros;
+  }
+
+  bool IsDirty() const
+  {
+    return _dirty;
+  }
+
+  void SetPixelColor(uint16_t index, typename T_COLOR_FEATURE::ColorObject color)
+  {
+    if (index < _pixelCount)
+    {
+      T_COLOR_FEATURE::applyPixelColor(_pixels.data(), index, RgbwColor(color));
+      _dirty = true;
+    }
+  }
+
+  typename T_COLOR_FEATURE::ColorObject GetPixelColor(uint16_t index) const
+  {
+    RgbwColor color = T_COLOR_FEATURE::retrievePixelColor(_pixels.data(), index);
+    return ToColorObject(color, (typename T_COLOR_FEATURE::ColorObject *)NULL);
+  }
+
+  void ClearTo(typename T_COLOR_FEATURE::ColorObject color)
+  {
+    for (uint16_t i = 0; i < _pixelCount; i++)
+    {
+      SetPixelColor(i, color);
+    }
+  }
+
+  uint8_t *Pixels()
+  {
+    _dirty = true;
+    return _pixels.data();
+  }
+
+  size_t PixelsSize() const
+  {
+    return _pixels.size();
+  }
+
+  uint16_t PixelCount() const
+  {
+    return _pixelCount;
+  }
+
+  uint32_t FrameCount() const
+  {
+    return _frames;
+  }
+
+private:
+  static RgbwColor ToColorObject(const RgbwColor &color, RgbwColor *)
+  {
+    return color;
+  }
+
+  static RgbColor ToColorObject(const RgbwColor &color, RgbColor *)
+  {
+    return RgbColor(color.R, color.G, color.B);
+  }
+
+  uint16_t _pixelCount;
+  uint8_t _pin;
+  std::vector<uint8_t> _pixels;
+  int64_t _busyUntilMicros = 0;
+  uint32_t _frames = 0;
+  bool _dirty = false;
+};
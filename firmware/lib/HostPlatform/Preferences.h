@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <vector>
+
+// In-memory stand-in for the NVS backed Preferences, shared by every instance of the process.
+class Preferences
+{
+public:
+  bool begin(const char *name, bool readOnly = false)
+  {
+    _namespace = name;
+    return true;
+  }
+
+  void end()
+  {
+  }
+
+  size_t putUInt(const char *key, uint32_t value)
+  {
+    return putBytes(key, &value, sizeof(value));
+  }
+
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0)
+  {
+    uint32_t value;
+    return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+  }
+
+  size_t putBytes(const char *key, const void *value, size_t length)
+  {
+    const uint8_t *bytes = (const uint8_t *)value;
+    Storage()[_namespace + key] = std::vector<uint8_t>(bytes, bytes + length);
+    return length;
+  }
+
+  size_t getBytesLength(const char *key)
+  {
+    auto entry = Storage().find(_namespace + key);
+    return entry == Storage().end() ? 0 : entry->second.size();
+  }
+
+  size_t getBytes(const char *key, void *buffer, size_t length)
+  {
+    auto entry = Storage().find(_namespace + key);
+    if (entry == Storage().end() || entry->second.size() > length)
+    {
+      return 0;
+    }
+
+    memcpy(buffer, entry->second.data(), entry->second.size());
+    return entry->second.size();
+  }
+
+  bool remove(const char *key)
+  {
+    return Storage().erase(_namespace + key) > 0;
+  }
+
+private:
+  static std::map<std::string, std::vector<uint8_t>> &Storage()
+  {
+    static std::map<std::string, std::vector<uint8_t>> storage;
+    return storage;
+  }
+
+  std::string _namespace;
+};
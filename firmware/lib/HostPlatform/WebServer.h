@@ -0,0 +1,136 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ESPAsyncWebServer.h>
+#include <functional>
+#include <vector>
+
+// Host stand-in for the synchronous ESP32 WebServer. On the device both servers take their
+// methods from http_parser, here they share the ones of the ESPAsyncWebServer stand-in.
+// Host programs set a request with SetRequest() and run its handler with Dispatch(), the last
+// response stays readable until the next one.
+typedef WebRequestMethod HTTPMethod;
+
+class WebServer
+{
+public:
+  typedef std::function<void(void)> THandlerFunction;
+
+  WebServer(int port = 80) {}
+
+  void begin() {}
+  void handleClient() {}
+
+  void on(const String &uri, THandlerFunction handler)
+  {
+    on(uri, HTTP_ANY, handler);
+  }
+
+  void on(const String &uri, HTTPMethod method, THandlerFunction handler)
+  {
+    _routes.push_back(Route{uri, method, handler});
+  }
+
+  void onNotFound(THandlerFunction handler)
+  {
+    _notFound = handler;
+  }
+
+  String uri() const { return _uri; }
+  HTTPMethod method() const { return HTTP_GET; }
+  String hostHeader() const { return _host; }
+  WiFiClient &client() { return _client; }
+
+  int args() const { return _args.size(); }
+  String argName(int index) const { return _args[index].first; }
+  String arg(int index) const { return _args[index].second; }
+
+  String arg(const String &name) const
+  {
+    for (const auto &arg : _args)
+    {
+      if (arg.first == name)
+        return arg.second;
+    }
+    return String();
+  }
+
+  bool hasArg(const String &name) const
+  {
+    for (const auto &arg : _args)
+    {
+      if (arg.first == name)
+        return true;
+    }
+    return false;
+  }
+
+  void sendHeader(const String &name, const String &value, bool first = false)
+  {
+    _headers.push_back(std::make_pair(name, value));
+  }
+
+  void send(int code, const String &contentType, const String &content)
+  {
+    _code = code;
+    _content = content;
+  }
+
+  // A GET of url, host is the Host header the captive portal checks.
+  void SetRequest(const char *url, const char *host = "192.168.4.1")
+  {
+    const char *query = strchr(url, '?');
+    _uri = query != NULL ? String(std::string(url, query - url)) : String(url);
+    _host = host;
+    _args.clear();
+    while (query != NULL)
+    {
+      const char *name = query + 1;
+      query = strchr(name, '&');
+      const char *end = query != NULL ? query : name + strlen(name);
+      const char *equals = (const char *)memchr(name, '=', end - name);
+      const char *valueStart = equals != NULL ? equals + 1 : end;
+      _args.push_back(std::make_pair(String(std::string(name, (equals != NULL ? equals : end) - name)), String(std::string(valueStart, end - valueStart))));
+    }
+  }
+
+  // Runs the handler registered for the request, the not found handler when there is none.
+  void Dispatch()
+  {
+    _headers.clear();
+    for (const Route &route : _routes)
+    {
+      if (route.uri == _uri)
+      {
+        route.handler();
+        return;
+      }
+    }
+    if (_notFound)
+    {
+      _notFound();
+    }
+  }
+
+  int ResponseCode() const { return _code; }
+  const String &ResponseContent() const { return _content; }
+
+private:
+  struct Route
+  {
+    String uri;
+    HTTPMethod method;
+    THandlerFunction handler;
+  };
+
+  std::vector<Route> _routes;
+  THandlerFunction _notFound;
+  WiFiClient _client;
+  String _uri;
+  String _host;
+  std::vector<std::pair<String, String>> _args;
+  std::vector<std::pair<String, String>> _headers;
+  int _code = 0;
+  String _content;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+// Host stand-in for the ESP32 station and soft AP. The station never connects, host programs
+// choose the networks a scan finds with SetScanResult().
+
+typedef enum
+{
+  WIFI_OFF = 0,
+  WIFI_STA,
+  WIFI_AP,
+  WIFI_AP_STA,
+} wifi_mode_t;
+
+typedef enum
+{
+  WIFI_AUTH_OPEN = 0,
+  WIFI_AUTH_WEP,
+  WIFI_AUTH_WPA_PSK,
+  WIFI_AUTH_WPA2_PSK,
+  WIFI_AUTH_WPA_WPA2_PSK,
+} wifi_auth_mode_t;
+
+typedef enum
+{
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_SCAN_COMPLETED = 2,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+// The connection of a request to the synchronous WebServer.
+class WiFiClient
+{
+public:
+  IPAddress localIP() const { return IPAddress(192, 168, 4, 1); }
+  void stop() {}
+};
+
+struct HostNetwork
+{
+  String ssid;
+  int32_t rssi;
+  wifi_auth_mode_t encryption;
+};
+
+class WiFiClass
+{
+public:
+  bool mode(wifi_mode_t mode)
+  {
+    _mode = mode;
+    return true;
+  }
+
+  bool softAPConfig(IPAddress ip, IPAddress gateway, IPAddress subnet) { return true; }
+  bool softAP(const char *ssid, const char *passphrase = NULL) { return true; }
+  IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+  String softAPmacAddress() { return "A4:CF:12:34:56:79"; }
+
+  wl_status_t begin(const char *ssid = NULL, const char *passphrase = NULL) { return WL_DISCONNECTED; }
+  bool config(IPAddress localIP, IPAddress gateway, IPAddress subnet) { return true; }
+  bool setHostname(const char *hostname) { return true; }
+  const char *getHostname() { return "host"; }
+  bool disconnect(bool wifiOff = false) { return true; }
+  wl_status_t status() { return WL_DISCONNECTED; }
+  uint8_t waitForConnectResult() { return status(); }
+
+  String SSID() const { return String(); }
+  String macAddress() { return "A4:CF:12:34:56:78"; }
+  IPAddress localIP() { return IPAddress(); }
+  IPAddress gatewayIP() { return IPAddress(); }
+  IPAddress subnetMask() { return IPAddress(); }
+  IPAddress dnsIP(uint8_t index = 0) { return IPAddress(); }
+
+  int16_t scanNetworks() { return _networks.size(); }
+  String SSID(uint8_t index) const { return _networks[index].ssid; }
+  int32_t RSSI(uint8_t index) const { return _networks[index].rssi; }
+  wifi_auth_mode_t encryptionType(uint8_t index) const { return _networks[index].encryption; }
+
+  void SetScanResult(const std::vector<HostNetwork> &networks) { _networks = networks; }
+
+private:
+  wifi_mode_t _mode = WIFI_OFF;
+  std::vector<HostNetwork> _networks;
+};
+
+inline WiFiClass WiFi;
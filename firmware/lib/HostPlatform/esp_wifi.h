@@ -0,0 +1,5 @@
+#pragma once
+
+#include <WiFi.h>
+
+inline int esp_wifi_disconnect() { return 0; }
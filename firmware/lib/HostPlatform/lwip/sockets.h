@@ -0,0 +1,8 @@
+#pragma once
+
+// The lwIP socket API follows BSD sockets, the host ones are used as they are.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
@@ -1,8 +1,26 @@
 #pragma once
 
+#include <atomic>
 #include <NeoPixelBus.h>
+#include <EventLog.h>
+#include "StripOutput.h"
 #include "WebDriver.h"
 
+// The render buffer is always RGBW, the conversion to the wire format of LED_STRIP_FEATURE
+// happens once per pixel when a frame is handed to the outputs.
+
+// Pixels reserved on each output at boot, a per-board build setting. Each bus is allocated once
+// at this size and NeoPixelBus always clocks out its whole buffer, so every frame costs the wire
+// time of the full capacity (30 us per RGBW pixel) however short the configured segments are.
+// Boards driving short runs should lower it, e.g. -DLED_STRIP_MAX_PIXEL_COUNT=150.
+#ifndef LED_STRIP_MAX_PIXEL_COUNT
+#define LED_STRIP_MAX_PIXEL_COUNT 600
+#endif
+
+#ifndef LED_STRIP_MAX_OUTPUTS
+#define LED_STRIP_MAX_OUTPUTS 4
+#endif
+
 static const RgbwColor Zero(HtmlColor(0x00000000));
 static const RgbwColor White(HtmlColor(0xff000000));
 static const RgbwColor Red(HtmlColor(0x00ff0000));
@@ -10,81 +28,430 @@ static const RgbwColor Green(HtmlColor(0x0000ff00));
 static const RgbwColor Blue(HtmlColor(0x000000ff));
 static const RgbwColor Candle(HtmlColor(0xFFFF0000));
 
+struct SegmentRange
+{
+  uint16_t start = 0;
+  uint16_t length = 0;
+  uint16_t gap = 0;
+  bool reversed = false;
+  uint8_t output = 0;
+};
+
 class LedStripDriver
 {
 public:
+  static const uint16_t MaxPixelCount = LED_STRIP_MAX_PIXEL_COUNT;
+  static const uint8_t MaxOutputCount = LED_STRIP_MAX_OUTPUTS;
+
   LedStripDriver(uint8_t pin)
   {
-    _stripDataPin = pin;    
+    _outputPins[0] = pin;
+    _outputCount = 1;
   }
 
-  void SetPixelCount(uint16_t pixelCount)
+  LedStripDriver(const uint8_t pins[], uint8_t outputCount)
   {
-    _pixelCount = pixelCount;
+    _outputCount = outputCount > MaxOutputCount ? MaxOutputCount : outputCount;
+    for (uint8_t i = 0; i < _outputCount; i++)
+    {
+      _outputPins[i] = pins[i];
+    }
+  }
+
+  typedef void (*OutputReadyHandler)();
+
+  // Allocates the outputs and the render buffer once for the full capacity, segments are laid
+  // out inside them afterwards. Output o owns the pixels [o * MaxPixelCount, (o + 1) * MaxPixelCount)
+  // of the render buffer. The output task owns the outputs from then on.
+  void Begin()
+  {
+    if (_pixels != NULL)
+    {
+      return;
+    }
 
-    if (strip != NULL)
+    _pixels = new RgbwColor[MaxPixelCount * _outputCount];
+    for (uint8_t i = 0; i < _outputCount; i++)
     {
-      delete strip;
+      _outputs[i] = CreateStripOutput<LED_STRIP_FEATURE>(i, MaxPixelCount, _outputPins[i]);
+      _outputs[i]->Begin();
     }
-    
-    strip = new NeoPixelBus<NeoGrbwFeature, Neo800KbpsMethod>(pixelCount, _stripDataPin);
-    strip->Begin();
+    MarkDirty(0, MaxPixelCount * _outputCount);
+
+    xTaskCreate(
+        OutputLoop,       /* Task function. */
+        "LedStripOutput", /* String with name of task. */
+        2000,             /* Stack size in words. */
+        this,             /* Parameter passed as input of the task */
+        2,                /* Priority of the task. */
+        &_outputTask);    /* Task handle. */
+  }
+
+  // Called from the output task once it can take a frame again after CommitFrame() turned one
+  // away because it was busy, so the caller can commit the pending pixels without polling.
+  void SetOutputReadyHandler(OutputReadyHandler handler)
+  {
+    _outputReadyHandler = handler;
   }
 
   void SetFullStripColor(RgbwColor color)
   {
-    for (int i = 0; i < _pixelCount; i++)
+    for (uint8_t i = 0; i < _outputCount; i++)
     {
-      strip->SetPixelColor(i, color);
+      FillRange(OutputBase(i), OutputBase(i) + _outputPixelCounts[i], color);
     }
-    strip->Show();
+  }
+
+  // Hands every pixel written since the last frame over to the output task, which starts all
+  // outputs back to back so they transmit in parallel while rendering of the next frame carries
+  // on in the render buffer. Returns false without touching the wire when nothing changed or
+  // when the previous frame is still being handed off; the pending changes then go out with
+  // the next commit.
+  bool CommitFrame()
+  {
+    if (_pixels == NULL || _dirtyBegin >= _dirtyEnd)
+    {
+      return false;
+    }
+
+    // Flagged before the busy check, the output task clears busy before it looks at the flag.
+    _commitDeferred = true;
+    if (_outputBusy)
+    {
+      return false;
+    }
+    _commitDeferred = false;
+
+    for (uint8_t i = 0; i < _outputCount; i++)
+    {
+      uint16_t begin = _dirtyBegin > OutputBase(i) ? _dirtyBegin : OutputBase(i);
+      uint16_t end = _dirtyEnd < OutputBase(i + 1) ? _dirtyEnd : OutputBase(i + 1);
+      if (begin < end)
+      {
+        _outputs[i]->Write(_pixels + begin, begin - OutputBase(i), end - begin);
+      }
+    }
+    _dirtyBegin = UINT16_MAX;
+    _dirtyEnd = 0;
+
+    _outputBusy = true;
+    xTaskNotifyGive(_outputTask);
+    return true;
+  }
+
+  bool IsOutputBusy() const
+  {
+    return _outputBusy;
+  }
+
+  // True while pixels changed since the last CommitFrame() that went out.
+  bool HasPendingFrame() const
+  {
+    return _dirtyBegin < _dirtyEnd;
+  }
+
+  uint8_t GetOutputCount() const
+  {
+    return _outputCount;
   }
 
   void SetSegmentColor(int segmentIndex, RgbwColor color)
   {
-    if (_segmentLengths[segmentIndex] == 0)
+    const SegmentRange &segment = GetSegment(segmentIndex);
+    if (segment.length == 0)
     {
-      Serial.println("Segment " + String(segmentIndex) + " is not configured and won't be set.");
+      LOG_WARN(LogSegmentNotConfigured, segmentIndex);
       return;
     }
 
-    int segmentBeginning = 0;    
-    for(int i = 0; i < segmentIndex; i++)
+    FillRange(segment.start, segment.start + segment.length, color);
+  }
+
+  // Copies a frame of count pixels laid out back to back over the used part of every output, in
+  // output order and ignoring segments, e.g. one received from a realtime stream.
+  void SetPixels(const RgbwColor *pixels, uint32_t count)
+  {
+    for (uint8_t i = 0; i < _outputCount && count > 0; i++)
+    {
+      uint16_t length = _outputPixelCounts[i] < count ? _outputPixelCounts[i] : count;
+      memcpy(_pixels + OutputBase(i), pixels, length * sizeof(RgbwColor));
+      MarkDirty(OutputBase(i), OutputBase(i) + length);
+      pixels += length;
+      count -= length;
+    }
+  }
+
+  // Writes a single pixel addressed relative to the segment, honoring its direction.
+  void SetSegmentPixelColor(int segmentIndex, uint16_t offset, RgbwColor color)
+  {
+    const SegmentRange &segment = GetSegment(segmentIndex);
+    if (offset >= segment.length)
     {
-      segmentBeginning += _segmentLengths[i];
+      return;
     }
-    Serial.println("Segment " + String(segmentIndex) + " starts at " + String(segmentBeginning));
-    
-    int segmentLenght = _segmentLengths[segmentIndex];
-    for (int i = segmentBeginning; i < segmentBeginning + segmentLenght; i++)
+
+    uint16_t pixel = SegmentPixel(segment, offset);
+    _pixels[pixel] = color;
+    MarkDirty(pixel, pixel + 1);
+  }
+
+  RgbwColor GetSegmentPixelColor(int segmentIndex, uint16_t offset) const
+  {
+    const SegmentRange &segment = GetSegment(segmentIndex);
+    return offset < segment.length ? _pixels[SegmentPixel(segment, offset)] : Zero;
+  }
+
+  RgbwColor GetPixelColor(uint16_t pixel) const
+  {
+    return _pixels[pixel];
+  }
+
+  // Indices past MaxSegmentCount read as an unconfigured segment.
+  const SegmentRange &GetSegment(int segmentIndex) const
+  {
+    static const SegmentRange Unconfigured;
+    if (segmentIndex < 0 || segmentIndex >= MaxSegmentCount)
     {
-      strip->SetPixelColor(i, color);
+      return Unconfigured;
     }
+    return _segments[segmentIndex];
+  }
 
-    strip->Show();
+  // Pixels used by the configured segments over all outputs.
+  uint16_t GetPixelCount() const
+  {
+    uint16_t pixelCount = 0;
+    for (uint8_t i = 0; i < _outputCount; i++)
+    {
+      pixelCount += _outputPixelCounts[i];
+    }
+    return pixelCount;
   }
 
-  void ConfigureSegment(StripSegment segment)
+  // Wire time of a frame: every output clocks out its whole capacity, 1.25 us per bit plus the
+  // 300 us latch of WS2812.
+  uint32_t GetFrameMicros() const
   {
-    if (_segmentLengths[segment.index] > 0)
-      SetSegmentColor(segment.index, Zero);
+    return (uint32_t)MaxPixelCount * LED_STRIP_FEATURE::PixelSize * 10 + 300;
+  }
 
-    _segmentLengths[segment.index] = segment.lenght;
+  // Resizes or moves one segment in place. On every output, the segments following it are
+  // shifted inside the buffer so they keep their colors, nothing is reallocated and the strip
+  // never blanks.
+  bool ConfigureSegment(StripSegment segment)
+  {
+    if (segment.index >= MaxSegmentCount)
+    {
+      return false;
+    }
 
-    unsigned int sumCount = 0;
-    for (int i = 0; i < 10; i++)
+    if (segment.output >= _outputCount)
     {
-      sumCount += _segmentLengths[i];
+      LOG_WARN(LogSegmentOutputMissing, segment.index, segment.output);
+      return false;
     }
 
-    Serial.println("Total pixel count of all segment within the strip: " + String(sumCount));
-    SetPixelCount(sumCount);
+    SegmentRange previous = _segments[segment.index];
+    uint16_t previousCursors[MaxOutputCount];
+    uint16_t previousPixelCounts[MaxOutputCount];
+    for (uint8_t i = 0; i < _outputCount; i++)
+    {
+      previousCursors[i] = LayoutCursor(i, segment.index);
+      previousPixelCounts[i] = _outputPixelCounts[i];
+    }
+
+    ApplySegment(segment);
+    if (!RebuildSegmentMap())
+    {
+      LOG_WARN(LogSegmentOverflow, segment.index, MaxPixelCount, segment.output);
+      _segments[segment.index] = previous;
+      RebuildSegmentMap();
+      return false;
+    }
+
+    // Everything after the segment on an output moves by the same amount.
+    for (uint8_t i = 0; i < _outputCount; i++)
+    {
+      uint16_t cursor = LayoutCursor(i, segment.index);
+      if (previousPixelCounts[i] > previousCursors[i] && cursor != previousCursors[i])
+      {
+        MovePixels(OutputBase(i) + previousCursors[i], OutputBase(i) + cursor, previousPixelCounts[i] - previousCursors[i]);
+      }
+
+      if (previousPixelCounts[i] > _outputPixelCounts[i])
+      {
+        FillRange(OutputBase(i) + _outputPixelCounts[i], OutputBase(i) + previousPixelCounts[i], Zero);
+      }
+    }
+
+    const SegmentRange &current = _segments[segment.index];
+    if (current.length > 0)
+    {
+      FillRange(current.start - current.gap, current.start, Zero);
+    }
+
+    LOG_INFO(LogPixelCount, GetPixelCount());
     SetSegmentColor(segment.index, White);
+    return true;
+  }
+
+  // Applies a whole configuration at once so the map is only rebuilt once.
+  // Segments that would overflow their output or target a missing one are left unconfigured.
+  void ConfigureSegments(const StripSegment segments[], size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      if (segments[i].index >= MaxSegmentCount)
+      {
+        continue;
+      }
+
+      ApplySegment(segments[i]);
+      if (segments[i].output >= _outputCount)
+      {
+        _segments[segments[i].index].length = 0;
+      }
+    }
+
+    for (int i = MaxSegmentCount - 1; i >= 0 && !RebuildSegmentMap(); i--)
+    {
+      if (_segments[i].length > 0 && _outputPixelCounts[_segments[i].output] > MaxPixelCount)
+      {
+        LOG_WARN(LogSegmentOverflow, i, MaxPixelCount, _segments[i].output);
+        _segments[i].length = 0;
+      }
+    }
+    RebuildSegmentMap();
+
+    FillRange(0, MaxPixelCount * _outputCount, Zero);
+    LOG_INFO(LogPixelCount, GetPixelCount());
   }
 
 protected:
-  NeoPixelBus<NeoGrbwFeature, Neo800KbpsMethod> *strip = NULL;
-  uint16_t _pixelCount;
-  uint8_t _stripDataPin;
-  unsigned int _segmentLengths[10];
+  static uint16_t SegmentPixel(const SegmentRange &segment, uint16_t offset)
+  {
+    return segment.reversed ? segment.start + segment.length - 1 - offset : segment.start + offset;
+  }
+
+  static uint16_t OutputBase(uint8_t output)
+  {
+    return output * MaxPixelCount;
+  }
+
+  static void OutputLoop(void *parameter)
+  {
+    LedStripDriver *driver = (LedStripDriver *)parameter;
+    while (1)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+      // Show() waits for the previous frame to leave that output, then starts this one and
+      // returns while the RMT channel is still sending it. Every output has its own channel,
+      // so starting them in a row has them all on the wire at once.
+      for (uint8_t i = 0; i < driver->_outputCount; i++)
+      {
+        driver->_outputs[i]->Show();
+      }
+      driver->_outputBusy = false;
+
+      if (driver->_commitDeferred.exchange(false) && driver->_outputReadyHandler != NULL)
+      {
+        driver->_outputReadyHandler();
+      }
+    }
+  }
+
+  void ApplySegment(const StripSegment &segment)
+  {
+    _segments[segment.index].length = segment.lenght;
+    _segments[segment.index].gap = segment.gap;
+    _segments[segment.index].reversed = segment.reversed != 0;
+    _segments[segment.index].output = segment.output;
+  }
+
+  // Lays the segments of each output out back to back from the start of that output, each one
+  // preceded by its gap of unlit pixels. Runs only on configuration changes so segment writes
+  // never have to walk the table. Returns false when an output overflows its capacity.
+  bool RebuildSegmentMap()
+  {
+    uint32_t next[MaxOutputCount] = {};
+    for (int i = 0; i < MaxSegmentCount; i++)
+    {
+      SegmentRange &segment = _segments[i];
+      uint8_t output = segment.output < _outputCount ? segment.output : 0;
+      if (segment.length == 0)
+      {
+        segment.start = OutputBase(output) + (next[output] < MaxPixelCount ? next[output] : MaxPixelCount);
+        continue;
+      }
+
+      segment.start = OutputBase(output) + next[output] + segment.gap;
+      next[output] += segment.gap + segment.length;
+    }
+
+    bool fits = true;
+    for (uint8_t i = 0; i < _outputCount; i++)
+    {
+      _outputPixelCounts[i] = next[i] > UINT16_MAX ? UINT16_MAX : next[i];
+      fits = fits && next[i] <= MaxPixelCount;
+    }
+    return fits;
+  }
+
+  // Pixels taken on an output by the segments up to and including lastSegment.
+  uint16_t LayoutCursor(uint8_t output, int lastSegment) const
+  {
+    uint16_t cursor = 0;
+    for (int i = 0; i <= lastSegment; i++)
+    {
+      if (_segments[i].length > 0 && _segments[i].output == output)
+      {
+        cursor += _segments[i].gap + _segments[i].length;
+      }
+    }
+    return cursor;
+  }
+
+  void FillRange(uint16_t begin, uint16_t end, RgbwColor color)
+  {
+    for (uint16_t i = begin; i < end; i++)
+    {
+      _pixels[i] = color;
+    }
+    MarkDirty(begin, end);
+  }
+
+  // Moves pixels within the render buffer, source and destination may overlap.
+  void MovePixels(uint16_t from, uint16_t to, uint16_t count)
+  {
+    uint16_t outputEnd = OutputBase(to / MaxPixelCount + 1);
+    if (to + count > outputEnd)
+    {
+      count = outputEnd - to;
+    }
+
+    memmove(_pixels + to, _pixels + from, count * sizeof(RgbwColor));
+    MarkDirty(from < to ? from : to, (from > to ? from : to) + count);
+  }
+
+  void MarkDirty(uint16_t begin, uint16_t end)
+  {
+    if (begin < _dirtyBegin)
+      _dirtyBegin = begin;
+    if (end > _dirtyEnd)
+      _dirtyEnd = end;
+  }
+
+  StripOutput *_outputs[MaxOutputCount] = {};
+  uint8_t _outputPins[MaxOutputCount];
+  uint8_t _outputCount;
+  uint16_t _outputPixelCounts[MaxOutputCount] = {};
+  RgbwColor *_pixels = NULL;
+  TaskHandle_t _outputTask = NULL;
+  std::atomic<bool> _outputBusy{false};
+  std::atomic<bool> _commitDeferred{false};
+  OutputReadyHandler _outputReadyHandler = NULL;
+  SegmentRange _segments[MaxSegmentCount];
+  uint16_t _dirtyBegin = UINT16_MAX;
+  uint16_t _dirtyEnd = 0;
 };
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <NeoPixelBus.h>
+#include <ColorPipeline.h>
+
+// Transport is picked per board build next to LED_STRIP_FEATURE, e.g.
+// -DLED_STRIP_FEATURE=NeoGrbFeature -DLED_STRIP_TRANSPORT=LED_STRIP_TRANSPORT_I2S
+#define LED_STRIP_TRANSPORT_RMT 0
+#define LED_STRIP_TRANSPORT_I2S 1
+#define LED_STRIP_TRANSPORT_BITBANG 2
+
+#ifndef LED_STRIP_TRANSPORT
+#define LED_STRIP_TRANSPORT LED_STRIP_TRANSPORT_RMT
+#endif
+
+// Converts render buffer pixels to the color object of the wire format, resolved at compile time.
+template <typename T_COLOR_OBJECT>
+struct PixelKernel;
+
+template <>
+struct PixelKernel<RgbwColor>
+{
+  static RgbwColor Convert(const RgbwColor &color)
+  {
+    return color;
+  }
+};
+
+// Strips without a white LED get the white channel mixed back into the primaries. Rendered colors
+// never carry one there, only fixed colors such as the segment identify white do.
+template <>
+struct PixelKernel<RgbColor>
+{
+  static RgbColor Convert(const RgbwColor &color)
+  {
+    uint16_t red = color.R + color.W;
+    uint16_t green = color.G + color.W;
+    uint16_t blue = color.B + color.W;
+    return RgbColor(red > 255 ? 255 : red, green > 255 ? 255 : green, blue > 255 ? 255 : blue);
+  }
+};
+
+// One physical data line. The driver calls into it once per frame, the per-pixel
+// copy stays inside the concrete output so it is never dispatched per pixel.
+class StripOutput
+{
+public:
+  virtual ~StripOutput() {}
+
+  virtual void Begin() = 0;
+
+  // Copies count pixels into the transport buffer starting at pixel first. Only called once the
+  // previous Show() has returned, the transmission of that frame may still be running.
+  virtual void Write(const RgbwColor *pixels, uint16_t first, uint16_t count) = 0;
+
+  // Starts sending the transport buffer and returns without waiting for the wire.
+  virtual void Show() = 0;
+
+  // True once the last frame has fully left the wire.
+  virtual bool CanShow() = 0;
+};
+
+template <typename T_COLOR_FEATURE, typename T_METHOD>
+class NeoPixelBusOutput : public StripOutput
+{
+public:
+  NeoPixelBusOutput(uint16_t pixelCount, uint8_t pin) : _bus(pixelCount, pin)
+  {
+  }
+
+  void Begin() override
+  {
+    _bus.Begin();
+  }
+
+  void Write(const RgbwColor *pixels, uint16_t first, uint16_t count) override
+  {
+    for (uint16_t i = 0; i < count; i++)
+    {
+      _bus.SetPixelColor(first + i, PixelKernel<typename T_COLOR_FEATURE::ColorObject>::Convert(pixels[i]));
+    }
+  }
+
+  void Show() override
+  {
+    _bus.Show();
+  }
+
+  bool CanShow() override
+  {
+    return _bus.CanShow();
+  }
+
+protected:
+  NeoPixelBus<T_COLOR_FEATURE, T_METHOD> _bus;
+};
+
+// With RMT each output gets its own channel so all of them transmit at the same time. I2S has
+// two buses, outputs past them fall back to RMT. Bit-bang blocks the output task for the whole
+// frame and sends the outputs one after the other, it only makes sense for a single short run.
+template <typename T_COLOR_FEATURE>
+static StripOutput *CreateStripOutput(uint8_t channel, uint16_t pixelCount, uint8_t pin)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+#if LED_STRIP_TRANSPORT == LED_STRIP_TRANSPORT_BITBANG
+  return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32BitBang800KbpsMethod>(pixelCount, pin);
+#else
+#if LED_STRIP_TRANSPORT == LED_STRIP_TRANSPORT_I2S
+  if (channel == 0)
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32I2s0800KbpsMethod>(pixelCount, pin);
+  if (channel == 1)
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32I2s1800KbpsMethod>(pixelCount, pin);
+#endif
+  switch (channel)
+  {
+  case 0:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt0800KbpsMethod>(pixelCount, pin);
+  case 1:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt1800KbpsMethod>(pixelCount, pin);
+  case 2:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt2800KbpsMethod>(pixelCount, pin);
+  case 3:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt3800KbpsMethod>(pixelCount, pin);
+  case 4:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt4800KbpsMethod>(pixelCount, pin);
+  case 5:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt5800KbpsMethod>(pixelCount, pin);
+  case 6:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt6800KbpsMethod>(pixelCount, pin);
+  default:
+    return new NeoPixelBusOutput<T_COLOR_FEATURE, NeoEsp32Rmt7800KbpsMethod>(pixelCount, pin);
+  }
+#endif
+#else
+  return new NeoPixelBusOutput<T_COLOR_FEATURE, Neo800KbpsMethod>(pixelCount, pin);
+#endif
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+#include <atomic>
+#include <lwip/sockets.h>
+#include <LedStripDriver.h>
+#include <EventLog.h>
+
+// Segment mode takes the strip back once no realtime packet arrived for this long.
+#ifndef LED_STRIP_REALTIME_TIMEOUT_MILLIS
+#define LED_STRIP_REALTIME_TIMEOUT_MILLIS 2500
+#endif
+
+// First E1.31 universe mapped to the strip, the following ones continue where it ends.
+#ifndef LED_STRIP_E131_UNIVERSE
+#define LED_STRIP_E131_UNIVERSE 1
+#endif
+
+// Channels per pixel of E1.31 data, 3 for RGB or 4 for RGBW. Pixels never span two universes.
+#ifndef LED_STRIP_E131_CHANNELS
+#define LED_STRIP_E131_CHANNELS 3
+#endif
+
+// Receives DDP and E1.31 (sACN) pixel streams on its own task. Payloads are copied channel by
+// channel straight into the back buffer of a triple buffer, laid out the way
+// LedStripDriver::SetPixels() expects. A frame is published once the stream marks it complete:
+// the DDP push flag, an E1.31 sync packet, or for E1.31 without synchronization the highest
+// universe of the stream. The strip manager takes the newest published frame whenever it gets
+// to it, a frame it had no time for is replaced by the next one.
+class RealtimeReceiver
+{
+public:
+  static const uint16_t DdpPort = 4048;
+  static const uint16_t E131Port = 5568;
+  static const uint16_t E131PixelsPerUniverse = 512 / LED_STRIP_E131_CHANNELS;
+
+  // Allocates the buffers for pixelCount pixels. Runs before the strip manager starts, it adds
+  // the frame signal to its queue set.
+  void Init(uint16_t pixelCount)
+  {
+    _pixelCount = pixelCount;
+    for (uint8_t i = 0; i < BufferCount; i++)
+    {
+      _buffers[i] = new RgbwColor[pixelCount];
+    }
+    _frameSignal = xSemaphoreCreateBinary();
+  }
+
+  // Opens the sockets and starts receiving, once the network is up.
+  void Begin()
+  {
+    xTaskCreate(
+        ReceiveLoop,        /* Task function. */
+        "RealtimeReceiver", /* String with name of task. */
+        3000,               /* Stack size in words. */
+        this,               /* Parameter passed as input of the task */
+        3,                  /* Priority of the task. */
+        NULL);              /* Task handle. */
+  }
+
+  // Given whenever a frame was published.
+  SemaphoreHandle_t GetFrameSignal() const
+  {
+    return _frameSignal;
+  }
+
+  uint16_t GetPixelCount() const
+  {
+    return _pixelCount;
+  }
+
+  uint32_t GetFrameCount() const
+  {
+    return _frames.load(std::memory_order_relaxed);
+  }
+
+  // The newest published frame not taken yet, NULL when there is none. It stays valid until
+  // the next call.
+  const RgbwColor *TakeFrame()
+  {
+    if ((_ready.load(std::memory_order_acquire) & FreshFrame) == 0)
+    {
+      return NULL;
+    }
+
+    _front = _ready.exchange(_front, std::memory_order_acq_rel) & BufferMask;
+    return _buffers[_front];
+  }
+
+  // Decodes one datagram received on port. Called by the receiving task, host programs feed
+  // packets through it directly.
+  bool HandlePacket(uint16_t port, const uint8_t *packet, size_t length)
+  {
+    return port == DdpPort ? HandleDdp(packet, length) : port == E131Port ? HandleE131(packet, length) : false;
+  }
+
+  // Forgets a stream that stopped, the next one starts from scratch.
+  void Reset()
+  {
+    _highestUniverse = 0;
+    _lastUniverse = 0;
+    _streamWrapped = false;
+    _syncAddress = 0;
+  }
+
+protected:
+  static const uint8_t BufferCount = 3;
+  static const uint8_t BufferMask = 0x03;
+  static const uint8_t FreshFrame = 0x04;
+
+  static const uint8_t DdpHeaderLength = 10;
+  static const uint8_t DdpVersionMask = 0xc0;
+  static const uint8_t DdpVersion1 = 0x40;
+  static const uint8_t DdpTimecode = 0x10;
+  static const uint8_t DdpQuery = 0x02;
+  static const uint8_t DdpPush = 0x01;
+  static const uint8_t DdpTypeRgbw = 3;
+  static const uint8_t DdpDefaultDestination = 1;
+  static const uint8_t DdpAllDestinations = 255;
+
+  static const uint8_t E131DataOffset = 126;
+  static const uint8_t E131SyncLength = 49;
+  static const uint32_t E131RootData = 0x00000004;
+  static const uint32_t E131RootExtended = 0x00000008;
+  static const uint32_t E131FramingData = 0x00000002;
+  static const uint32_t E131FramingSync = 0x00000001;
+  static const uint8_t E131PreviewData = 0x80;
+
+  static uint16_t Read16(const uint8_t *data)
+  {
+    return (data[0] << 8) | data[1];
+  }
+
+  static uint32_t Read32(const uint8_t *data)
+  {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | (data[2] << 8) | data[3];
+  }
+
+  // Header: flags, sequence, data type, destination, 32 bit byte offset, 16 bit length, then an
+  // optional timecode.
+  bool HandleDdp(const uint8_t *packet, size_t length)
+  {
+    if (length < DdpHeaderLength || (packet[0] & DdpVersionMask) != DdpVersion1 || (packet[0] & DdpQuery) != 0)
+    {
+      return false;
+    }
+    if (packet[3] != DdpDefaultDestination && packet[3] != DdpAllDestinations)
+    {
+      return false;
+    }
+
+    size_t headerLength = DdpHeaderLength + ((packet[0] & DdpTimecode) != 0 ? 4 : 0);
+    uint16_t dataLength = Read16(packet + 8);
+    if (headerLength + dataLength > length)
+    {
+      return false;
+    }
+
+    uint8_t channels = ((packet[2] >> 3) & 0x07) == DdpTypeRgbw ? 4 : 3;
+    CopyChannels(Read32(packet + 4), packet + headerLength, dataLength, channels);
+    if ((packet[0] & DdpPush) != 0)
+    {
+      PublishFrame();
+    }
+    return true;
+  }
+
+  bool HandleE131(const uint8_t *packet, size_t length)
+  {
+    static const uint8_t AcnPacketIdentifier[12] = {'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0};
+    if (length < 44 || memcmp(packet + 4, AcnPacketIdentifier, sizeof(AcnPacketIdentifier)) != 0)
+    {
+      return false;
+    }
+
+    uint32_t rootVector = Read32(packet + 18);
+    uint32_t framingVector = Read32(packet + 40);
+    if (rootVector == E131RootExtended && framingVector == E131FramingSync && length >= E131SyncLength)
+    {
+      if (_syncAddress != 0 && Read16(packet + 45) == _syncAddress)
+      {
+        PublishFrame();
+      }
+      return true;
+    }
+
+    if (rootVector != E131RootData || framingVector != E131FramingData || length < E131DataOffset ||
+        packet[117] != 0x02 || packet[125] != 0 || (packet[112] & E131PreviewData) != 0)
+    {
+      return false;
+    }
+
+    uint16_t universe = Read16(packet + 113);
+    uint16_t channelCount = Read16(packet + 123) - 1;
+    if (universe < LED_STRIP_E131_UNIVERSE || channelCount > 512 || (size_t)E131DataOffset + channelCount > length)
+    {
+      return false;
+    }
+
+    // Synchronized streams say when a frame is complete. Otherwise it is once its highest universe
+    // arrived, which is only known after the stream wrapped around once: the first frame goes
+    // out when the next one starts.
+    _syncAddress = Read16(packet + 109);
+    bool wrapped = universe <= _lastUniverse;
+    if (_syncAddress == 0 && wrapped && !_streamWrapped)
+    {
+      PublishFrame();
+    }
+    _streamWrapped = _streamWrapped || wrapped;
+    _lastUniverse = universe;
+    _highestUniverse = universe > _highestUniverse ? universe : _highestUniverse;
+
+    uint16_t usedChannels = E131PixelsPerUniverse * LED_STRIP_E131_CHANNELS;
+    uint32_t firstPixel = (uint32_t)(universe - LED_STRIP_E131_UNIVERSE) * E131PixelsPerUniverse;
+    CopyChannels(firstPixel * LED_STRIP_E131_CHANNELS, packet + E131DataOffset, channelCount < usedChannels ? channelCount : usedChannels, LED_STRIP_E131_CHANNELS);
+
+    if (_syncAddress == 0 && _streamWrapped && universe == _highestUniverse)
+    {
+      PublishFrame();
+    }
+    return true;
+  }
+
+  // Writes length channels starting at channel offset of a stream with channels per pixel into
+  // the back buffer. RGB streams leave the white channel dark.
+  void CopyChannels(uint32_t offset, const uint8_t *data, uint16_t length, uint8_t channels)
+  {
+    static_assert(sizeof(RgbwColor) == 4, "Channels are written into the R, G, B and W bytes of the buffer.");
+    uint32_t pixel = offset / channels;
+    if (pixel >= _pixelCount)
+    {
+      return;
+    }
+
+    uint8_t channel = offset % channels;
+    uint8_t *target = (uint8_t *)(_buffers[_back] + pixel) + channel;
+    uint16_t i = 0;
+
+    // Whole pixels in one go, the channel loop below only sees a partial pixel at either end.
+    if (channel == 0)
+    {
+      uint32_t pixels = length / channels;
+      pixels = pixels < _pixelCount - pixel ? pixels : _pixelCount - pixel;
+      if (channels == 4)
+      {
+        memcpy(target, data, pixels * 4);
+      }
+      else
+      {
+        for (uint32_t p = 0; p < pixels; p++)
+        {
+          target[p * 4] = data[p * 3];
+          target[p * 4 + 1] = data[p * 3 + 1];
+          target[p * 4 + 2] = data[p * 3 + 2];
+          target[p * 4 + 3] = 0;
+        }
+      }
+      i = pixels * channels;
+      pixel += pixels;
+      target += pixels * 4;
+    }
+
+    for (; i < length && pixel < _pixelCount; i++)
+    {
+      *target++ = data[i];
+      if (++channel == channels)
+      {
+        if (channels == 3)
+        {
+          *target++ = 0;
+        }
+        channel = 0;
+        pixel++;
+      }
+    }
+  }
+
+  void PublishFrame()
+  {
+    uint8_t published = _back;
+    _back = _ready.exchange(published | FreshFrame, std::memory_order_acq_rel) & BufferMask;
+
+    // A stream may only update part of the strip, the next frame builds on this one.
+    memcpy(_buffers[_back], _buffers[published], _pixelCount * sizeof(RgbwColor));
+    _frames.fetch_add(1, std::memory_order_relaxed);
+    xSemaphoreGive(_frameSignal);
+  }
+
+  static int OpenSocket(uint16_t port)
+  {
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (udp < 0 || bind(udp, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+      LOG_ERROR(LogRealtimeSocketFailed, port);
+      if (udp >= 0)
+      {
+        close(udp);
+      }
+      return -1;
+    }
+    return udp;
+  }
+
+  static void ReceiveLoop(void *parameter)
+  {
+    RealtimeReceiver *receiver = (RealtimeReceiver *)parameter;
+    const uint16_t ports[] = {DdpPort, E131Port};
+    int sockets[] = {OpenSocket(DdpPort), OpenSocket(E131Port)};
+
+    while (1)
+    {
+      fd_set readable;
+      FD_ZERO(&readable);
+      int highest = -1;
+      for (uint8_t i = 0; i < 2; i++)
+      {
+        if (sockets[i] >= 0)
+        {
+          FD_SET(sockets[i], &readable);
+          highest = sockets[i] > highest ? sockets[i] : highest;
+        }
+      }
+      if (highest < 0)
+      {
+        vTaskDelete(NULL);
+        return;
+      }
+
+      timeval timeout = {LED_STRIP_REALTIME_TIMEOUT_MILLIS / 1000, (LED_STRIP_REALTIME_TIMEOUT_MILLIS % 1000) * 1000};
+      if (select(highest + 1, &readable, NULL, NULL, &timeout) <= 0)
+      {
+        receiver->Reset();
+        continue;
+      }
+
+      for (uint8_t i = 0; i < 2; i++)
+      {
+        if (sockets[i] >= 0 && FD_ISSET(sockets[i], &readable))
+        {
+          int length = recv(sockets[i], receiver->_packet, sizeof(receiver->_packet), 0);
+          if (length > 0)
+          {
+            receiver->HandlePacket(ports[i], receiver->_packet, length);
+          }
+        }
+      }
+    }
+  }
+
+  uint16_t _pixelCount = 0;
+  RgbwColor *_buffers[BufferCount] = {};
+  // Index of the published buffer, FreshFrame while it was not taken.
+  std::atomic<uint8_t> _ready{1};
+  uint8_t _back = 0;
+  uint8_t _front = 2;
+  std::atomic<uint32_t> _frames{0};
+  SemaphoreHandle_t _frameSignal = NULL;
+  uint16_t _highestUniverse = 0;
+  uint16_t _lastUniverse = 0;
+  bool _streamWrapped = false;
+  uint16_t _syncAddress = 0;
+  uint8_t _packet[1472];
+};
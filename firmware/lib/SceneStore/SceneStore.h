@@ -0,0 +1,422 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <EventLog.h>
+
+// Number of scenes kept in flash.
+#ifndef LED_STRIP_MAX_SCENES
+#define LED_STRIP_MAX_SCENES 16
+#endif
+
+// Scenes saved or deleted but not written yet. Saving another scene while all are taken fails
+// until the flush task caught up.
+#ifndef LED_STRIP_SCENE_WRITE_SLOTS
+#define LED_STRIP_SCENE_WRITE_SLOTS 2
+#endif
+
+// How long scenes have to stay unchanged before they are written, and how long a stream of
+// changes may hold a write back at most.
+#ifndef SCENE_FLUSH_DELAY_MILLIS
+#define SCENE_FLUSH_DELAY_MILLIS 500
+#endif
+
+#ifndef SCENE_FLUSH_MAX_DELAY_MILLIS
+#define SCENE_FLUSH_MAX_DELAY_MILLIS 5000
+#endif
+
+// A segment state as it is kept in flash.
+struct StoredSegmentState
+{
+  uint16_t hue;
+  uint16_t transition;
+  uint8_t valid;
+  uint8_t onOff;
+  uint8_t saturation;
+  uint8_t brightness;
+  uint8_t effect;
+  uint8_t speed;
+  uint8_t easing;
+  uint8_t reserved;
+};
+
+// Named snapshots of segment states. A scene only holds the segments in its mask and is stored
+// as one blob of its name, the mask and the states of those segments. Names and masks stay in
+// RAM for listing and lookup, the states are read back from flash when a scene is loaded.
+// Saves and deletes take effect right away and are written from the store's own task once they
+// settle, so the web task never waits for flash.
+template <uint16_t T_SEGMENT_COUNT, uint8_t T_SCENE_COUNT>
+class SceneStore
+{
+public:
+  static const uint8_t SceneCount = T_SCENE_COUNT;
+  static const uint8_t NameLength = 15;
+  static const uint16_t MaskWords = (T_SEGMENT_COUNT + 31) / 32;
+
+  struct Scene
+  {
+    char name[NameLength + 1];
+    uint32_t mask[MaskWords];
+    StoredSegmentState states[T_SEGMENT_COUNT];
+
+    bool Contains(uint16_t index) const
+    {
+      return index < T_SEGMENT_COUNT && (mask[index / 32] & (1UL << (index % 32))) != 0;
+    }
+
+    void Add(uint16_t index, const StoredSegmentState &state)
+    {
+      if (index < T_SEGMENT_COUNT)
+      {
+        mask[index / 32] |= 1UL << (index % 32);
+        states[index] = state;
+      }
+    }
+
+    void Clear()
+    {
+      memset(this, 0, sizeof(Scene));
+    }
+  };
+
+  // Reads the names and masks of every scene and starts the flush task.
+  void Begin()
+  {
+    Preferences preferences;
+    preferences.begin(PreferenceNamespace, true);
+    for (uint8_t id = 0; id < SceneCount; id++)
+    {
+      char key[KeyLength];
+      SceneKey(id, key);
+      Header &header = _headers[id];
+      size_t length = preferences.getBytesLength(key);
+      if (length < sizeof(Header) || preferences.getBytes(key, _blob, sizeof(_blob)) != length)
+      {
+        memset(&header, 0, sizeof(Header));
+        continue;
+      }
+
+      memcpy(&header, _blob, sizeof(Header));
+      header.name[NameLength] = '\0';
+      if (length != sizeof(Header) + CountSegments(header.mask) * sizeof(StoredSegmentState))
+      {
+        memset(&header, 0, sizeof(Header));
+      }
+    }
+    preferences.end();
+
+    xTaskCreate(
+        FlushLoop,         /* Task function. */
+        "SceneFlush",      /* String with name of task. */
+        3000,              /* Stack size in words. */
+        this,              /* Parameter passed as input of the task */
+        0,                 /* Priority of the task. */
+        &_flushTask);      /* Task handle. */
+  }
+
+  bool IsUsed(uint8_t id) const
+  {
+    return id < SceneCount && _headers[id].name[0] != '\0';
+  }
+
+  const char *GetName(uint8_t id) const
+  {
+    return id < SceneCount ? _headers[id].name : "";
+  }
+
+  uint16_t GetSegmentCount(uint8_t id) const
+  {
+    return id < SceneCount ? CountSegments(_headers[id].mask) : 0;
+  }
+
+  // Id of the scene with that name, -1 when there is none.
+  int Find(const char *name) const
+  {
+    for (uint8_t id = 0; id < SceneCount; id++)
+    {
+      if (IsUsed(id) && strncmp(_headers[id].name, name, NameLength) == 0)
+      {
+        return id;
+      }
+    }
+    return -1;
+  }
+
+  // Id of the first unused scene, -1 when all are taken.
+  int FindFree() const
+  {
+    for (uint8_t id = 0; id < SceneCount; id++)
+    {
+      if (!IsUsed(id))
+      {
+        return id;
+      }
+    }
+    return -1;
+  }
+
+  bool Load(uint8_t id, Scene &scene)
+  {
+    if (!IsUsed(id))
+    {
+      return false;
+    }
+
+    // A scene not written yet is read from its write slot.
+    size_t length = 0;
+    portENTER_CRITICAL(&_lock);
+    int slot = FindSlot(id);
+    if (slot >= 0 && _writes[slot].operation == OperationSave)
+    {
+      length = _writes[slot].length;
+      memcpy(_blob, _writes[slot].blob, length);
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (slot < 0)
+    {
+      char key[KeyLength];
+      SceneKey(id, key);
+      Preferences preferences;
+      preferences.begin(PreferenceNamespace, true);
+      length = preferences.getBytes(key, _blob, sizeof(_blob));
+      preferences.end();
+    }
+
+    Header header;
+    memcpy(&header, _blob, sizeof(Header));
+    if (length != sizeof(Header) + CountSegments(header.mask) * sizeof(StoredSegmentState))
+    {
+      return false;
+    }
+
+    scene.Clear();
+    memcpy(scene.name, header.name, sizeof(scene.name));
+    memcpy(scene.mask, header.mask, sizeof(scene.mask));
+    const uint8_t *stored = _blob + sizeof(Header);
+    for (uint16_t index = 0; index < T_SEGMENT_COUNT; index++)
+    {
+      if (scene.Contains(index))
+      {
+        memcpy(&scene.states[index], stored, sizeof(StoredSegmentState));
+        stored += sizeof(StoredSegmentState);
+      }
+    }
+    return true;
+  }
+
+  // The name has to be non-empty, longer names are cut to NameLength. False as well while every
+  // write slot is taken.
+  bool Save(uint8_t id, const char *name, const Scene &scene)
+  {
+    if (id >= SceneCount || name == NULL || name[0] == '\0')
+    {
+      return false;
+    }
+
+    Header header = {};
+    strncpy(header.name, name, NameLength);
+    memcpy(header.mask, scene.mask, sizeof(header.mask));
+    memcpy(_blob, &header, sizeof(Header));
+    uint8_t *stored = _blob + sizeof(Header);
+    for (uint16_t index = 0; index < T_SEGMENT_COUNT; index++)
+    {
+      if (scene.Contains(index))
+      {
+        memcpy(stored, &scene.states[index], sizeof(StoredSegmentState));
+        stored += sizeof(StoredSegmentState);
+      }
+    }
+
+    portENTER_CRITICAL(&_lock);
+    int slot = TakeSlot(id);
+    if (slot >= 0)
+    {
+      _writes[slot].operation = OperationSave;
+      _writes[slot].length = stored - _blob;
+      memcpy(_writes[slot].blob, _blob, _writes[slot].length);
+      _headers[id] = header;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    ScheduleFlush();
+    return slot >= 0;
+  }
+
+  // False when there is no such scene or every write slot is taken.
+  bool Remove(uint8_t id)
+  {
+    if (!IsUsed(id))
+    {
+      return false;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    int slot = TakeSlot(id);
+    if (slot >= 0)
+    {
+      _writes[slot].operation = OperationRemove;
+      memset(&_headers[id], 0, sizeof(Header));
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    ScheduleFlush();
+    return slot >= 0;
+  }
+
+protected:
+  struct Header
+  {
+    char name[NameLength + 1];
+    uint32_t mask[MaskWords];
+  };
+
+  static const uint16_t BlobLength = sizeof(Header) + T_SEGMENT_COUNT * sizeof(StoredSegmentState);
+
+  enum Operation : uint8_t
+  {
+    OperationNone,
+    OperationSave,
+    OperationRemove
+  };
+
+  // A save or delete waiting for the flush task. The generation tells the task whether the slot
+  // was taken again while it wrote it.
+  struct PendingWrite
+  {
+    uint8_t id;
+    Operation operation;
+    uint16_t length;
+    uint32_t generation;
+    uint8_t blob[BlobLength];
+  };
+
+  static const uint8_t KeyLength = 16;
+  const static char *PreferenceNamespace;
+
+  static void SceneKey(uint8_t id, char *key)
+  {
+    snprintf(key, KeyLength, "scene%u", id);
+  }
+
+  // Both only run under _lock.
+  int FindSlot(uint8_t id) const
+  {
+    for (int slot = 0; slot < LED_STRIP_SCENE_WRITE_SLOTS; slot++)
+    {
+      if (_writes[slot].operation != OperationNone && _writes[slot].id == id)
+      {
+        return slot;
+      }
+    }
+    return -1;
+  }
+
+  // The slot already holding the scene is replaced, otherwise a free one is taken.
+  int TakeSlot(uint8_t id)
+  {
+    int slot = FindSlot(id);
+    for (int free = 0; slot < 0 && free < LED_STRIP_SCENE_WRITE_SLOTS; free++)
+    {
+      if (_writes[free].operation == OperationNone)
+      {
+        slot = free;
+      }
+    }
+    if (slot >= 0)
+    {
+      _writes[slot].id = id;
+      _writes[slot].generation = ++_generation;
+    }
+    return slot;
+  }
+
+  void ScheduleFlush()
+  {
+    if (_flushTask != NULL)
+    {
+      xTaskNotifyGive(_flushTask);
+    }
+  }
+
+  // Waits for the first change, then for a quiet period, and writes every pending slot. A slot
+  // that failed stays pending and is tried again with the next change.
+  static void FlushLoop(void *parameter)
+  {
+    SceneStore *store = (SceneStore *)parameter;
+    PendingWrite write;
+    while (1)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      TickType_t firstChange = xTaskGetTickCount();
+      while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SCENE_FLUSH_DELAY_MILLIS)) != 0 &&
+             xTaskGetTickCount() - firstChange < pdMS_TO_TICKS(SCENE_FLUSH_MAX_DELAY_MILLIS))
+      {
+      }
+
+      for (int slot = 0; slot < LED_STRIP_SCENE_WRITE_SLOTS; slot++)
+      {
+        portENTER_CRITICAL(&store->_lock);
+        write = store->_writes[slot];
+        portEXIT_CRITICAL(&store->_lock);
+        if (write.operation == OperationNone)
+        {
+          continue;
+        }
+
+        bool written = WriteScene(write);
+        portENTER_CRITICAL(&store->_lock);
+        if (written && store->_writes[slot].generation == write.generation)
+        {
+          store->_writes[slot].operation = OperationNone;
+        }
+        portEXIT_CRITICAL(&store->_lock);
+
+        if (!written)
+        {
+          LOG_WARN(LogSceneWriteFailed, write.id);
+        }
+      }
+    }
+  }
+
+  static bool WriteScene(const PendingWrite &write)
+  {
+    char key[KeyLength];
+    SceneKey(write.id, key);
+    Preferences preferences;
+    preferences.begin(PreferenceNamespace);
+    bool written = true;
+    if (write.operation == OperationSave)
+    {
+      written = preferences.putBytes(key, write.blob, write.length) == write.length;
+    }
+    else
+    {
+      preferences.remove(key);
+    }
+    preferences.end();
+    return written;
+  }
+
+  static uint16_t CountSegments(const uint32_t *mask)
+  {
+    uint16_t count = 0;
+    for (uint16_t word = 0; word < MaskWords; word++)
+    {
+      count += __builtin_popcount(mask[word]);
+    }
+    return count;
+  }
+
+  Header _headers[T_SCENE_COUNT];
+  // Scratch for one blob, loads and saves only happen on the web task.
+  uint8_t _blob[BlobLength];
+  PendingWrite _writes[LED_STRIP_SCENE_WRITE_SLOTS] = {};
+  uint32_t _generation = 0;
+  TaskHandle_t _flushTask = NULL;
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+template <uint16_t T_SEGMENT_COUNT, uint8_t T_SCENE_COUNT>
+const char *SceneStore<T_SEGMENT_COUNT, T_SCENE_COUNT>::PreferenceNamespace = "scenes";
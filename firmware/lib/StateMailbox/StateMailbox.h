@@ -0,0 +1,150 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+// One slot per segment holding only the newest state. Writers never wait for the reader, a
+// state published before the reader got to the previous one simply replaces it. Each slot is
+// a seqlock: the sequence is odd while a writer copies, readers retry until they saw a stable
+// even sequence on both sides of their copy. Writers copy inside a critical section, so none
+// of them can be preempted halfway and leave another writer or the reader spinning.
+template <typename T_STATE, uint16_t T_SLOT_COUNT>
+class StateMailbox
+{
+public:
+  static const uint16_t SlotCount = T_SLOT_COUNT;
+
+  void Begin()
+  {
+    _signal = xSemaphoreCreateBinary();
+  }
+
+  // Given after every publish, for the reader to wait on or add to a queue set.
+  SemaphoreHandle_t GetSignal() const
+  {
+    return _signal;
+  }
+
+  bool Publish(uint16_t slot, const T_STATE &state)
+  {
+    if (slot >= SlotCount)
+    {
+      return false;
+    }
+
+    std::atomic<uint32_t> &sequence = _slots[slot].sequence;
+    portENTER_CRITICAL(&_writeLock);
+    uint32_t current = sequence.load(std::memory_order_relaxed);
+    sequence.store(current + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy((void *)&_slots[slot].state, &state, sizeof(T_STATE));
+    sequence.store(current + 2, std::memory_order_release);
+    portEXIT_CRITICAL(&_writeLock);
+
+    uint32_t bit = 1UL << (slot % 32);
+    if ((_pending[slot / 32].fetch_or(bit, std::memory_order_release) & bit) != 0)
+    {
+      _coalesced.fetch_add(1, std::memory_order_relaxed);
+    }
+    xSemaphoreGive(_signal);
+    return true;
+  }
+
+  // States published while a Transaction lives reach the reader as a whole: it does not
+  // report the mailbox settled while one is open or any state is pending. It commits when it
+  // goes out of scope, whichever way the writer leaves.
+  class Transaction
+  {
+  public:
+    explicit Transaction(StateMailbox &mailbox) : _mailbox(mailbox)
+    {
+      _mailbox._openTransactions.fetch_add(1);
+    }
+
+    ~Transaction()
+    {
+      _mailbox._openTransactions.fetch_sub(1);
+      xSemaphoreGive(_mailbox._signal);
+    }
+
+  private:
+    Transaction(const Transaction &);
+    Transaction &operator=(const Transaction &);
+
+    StateMailbox &_mailbox;
+  };
+
+  // True once every published state was received and no transaction is open, the reader only
+  // acts on what it received when the mailbox is settled.
+  bool IsSettled() const
+  {
+    if (_openTransactions.load() != 0)
+    {
+      return false;
+    }
+
+    for (uint16_t word = 0; word < PendingWords; word++)
+    {
+      if (_pending[word].load() != 0)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // States replaced before the reader got to them.
+  uint32_t GetCoalescedCount() const
+  {
+    return _coalesced.load(std::memory_order_relaxed);
+  }
+
+  // Takes the newest state of the next slot that changed, false once none is left.
+  bool Receive(T_STATE &state)
+  {
+    for (uint16_t word = 0; word < PendingWords; word++)
+    {
+      uint32_t pending = _pending[word].load(std::memory_order_acquire);
+      if (pending == 0)
+      {
+        continue;
+      }
+
+      uint16_t bit = __builtin_ctz(pending);
+      _pending[word].fetch_and(~(1UL << bit), std::memory_order_acq_rel);
+      Read(word * 32 + bit, state);
+      return true;
+    }
+    return false;
+  }
+
+protected:
+  static const uint16_t PendingWords = (T_SLOT_COUNT + 31) / 32;
+
+  struct Slot
+  {
+    std::atomic<uint32_t> sequence{0};
+    T_STATE state;
+  };
+
+  void Read(uint16_t slot, T_STATE &state)
+  {
+    const std::atomic<uint32_t> &sequence = _slots[slot].sequence;
+    uint32_t before;
+    uint32_t after;
+    do
+    {
+      before = sequence.load(std::memory_order_acquire);
+      memcpy(&state, (const void *)&_slots[slot].state, sizeof(T_STATE));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = sequence.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+  }
+
+  Slot _slots[T_SLOT_COUNT];
+  std::atomic<uint32_t> _pending[PendingWords] = {};
+  std::atomic<uint32_t> _openTransactions{0};
+  std::atomic<uint32_t> _coalesced{0};
+  portMUX_TYPE _writeLock = portMUX_INITIALIZER_UNLOCKED;
+  SemaphoreHandle_t _signal = NULL;
+};
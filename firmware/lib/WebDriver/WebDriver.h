@@ -2,8 +2,55 @@
 
 #include <WebServer.h>
 #include <string>
+#include <atomic>
+#include <EventLog.h>
+#include <StateMailbox.h>
+#include <SceneStore.h>
+#include <AdmissionControl.h>
 #include "ESPAsyncWebServer.h"
 
+// Segments addressable on one controller, every per-segment table is sized from it.
+#ifndef LED_STRIP_MAX_SEGMENTS
+#define LED_STRIP_MAX_SEGMENTS 64
+#endif
+
+const uint16_t MaxSegmentCount = LED_STRIP_MAX_SEGMENTS;
+
+// Frames per second while something animates, state events are pushed at most once per frame.
+// The renderer lowers it when a frame needs more wire time, see LED_STRIP_MAX_PIXEL_COUNT.
+#ifndef LED_STRIP_FRAME_RATE
+#define LED_STRIP_FRAME_RATE 50
+#endif
+
+// Default duration of the crossfade applied to every segment state change.
+#ifndef LED_STRIP_TRANSITION_MILLIS
+#define LED_STRIP_TRANSITION_MILLIS 300
+#endif
+
+enum SegmentEffect
+{
+  EffectSolid = 0,
+  EffectFade = 1,
+  EffectRainbow = 2,
+  EffectChase = 3,
+  EffectTwinkle = 4,
+  EffectBreathe = 5,
+  EffectCount
+};
+
+static const char *SegmentEffectNames[EffectCount] = {"solid", "fade", "rainbow", "chase", "twinkle", "breathe"};
+
+enum TransitionEasing
+{
+  EasingLinear = 0,
+  EasingIn = 1,
+  EasingOut = 2,
+  EasingInOut = 3,
+  EasingCount
+};
+
+static const char *TransitionEasingNames[EasingCount] = {"linear", "in", "out", "inout"};
+
 struct StripSegmentState
 {
   unsigned int index;
@@ -11,134 +58,1061 @@ struct StripSegmentState
   unsigned int hue;
   unsigned int saturation;
   unsigned int brightness;
+  unsigned int effect;
+  unsigned int speed;
+  unsigned int transition;
+  unsigned int easing;
+};
+
+// One record of a /batch body, little endian. Only the fields flagged in fields are changed.
+struct BatchUpdate
+{
+  uint16_t index;
+  uint16_t fields;
+  uint16_t hue;
+  uint16_t transition;
+  uint8_t onOff;
+  uint8_t saturation;
+  uint8_t brightness;
+  uint8_t effect;
+  uint8_t speed;
+  uint8_t easing;
+};
+
+enum BatchField
+{
+  BatchOnOff = 1 << 0,
+  BatchHue = 1 << 1,
+  BatchSaturation = 1 << 2,
+  BatchBrightness = 1 << 3,
+  BatchEffect = 1 << 4,
+  BatchSpeed = 1 << 5,
+  BatchTransition = 1 << 6,
+  BatchEasing = 1 << 7
+};
+
+// First byte of a /ws message. Set carries BatchUpdate records, Query the 16 bit indices of the
+// segments asked for or nothing for all of them. State answers a query with one BatchUpdate per
+// segment with every field set, Error carries the type of the message it rejects. Retry carries
+// the type of a valid message that was dropped because the client or the controller is over its
+// command rate, it can be sent again after a second.
+enum SocketMessage
+{
+  SocketSet = 0x01,
+  SocketQuery = 0x02,
+  SocketState = 0x81,
+  SocketRetry = 0xfe,
+  SocketError = 0xff
+};
+
+// Query parameters the routes understand, each one is a bit in RequestParams::present.
+enum RequestParam
+{
+  ParamIndex,
+  ParamHue,
+  ParamSaturation,
+  ParamBrightness,
+  ParamEffect,
+  ParamSpeed,
+  ParamTransition,
+  ParamEasing,
+  ParamLength,
+  ParamGap,
+  ParamReverse,
+  ParamOutput,
+  ParamId,
+  ParamName,
+  ParamSegments,
+  ParamSince,
+  ParamCount
+};
+
+enum ParamKind
+{
+  ParamNumber,
+  ParamEffectName,
+  ParamEasingName,
+  ParamText
+};
+
+// Numbers are checked against max, the largest value a segment state takes, e.g. hue in degrees
+// and percentages. /batch and /ws records are held to the same limits. Effects and easings are
+// given by name or number.
+struct ParamRule
+{
+  const char *name;
+  ParamKind kind;
+  uint32_t max;
+};
+
+static const ParamRule RequestParamRules[ParamCount] = {
+    {"index", ParamNumber, MaxSegmentCount - 1},
+    {"h", ParamNumber, 359},
+    {"s", ParamNumber, 100},
+    {"b", ParamNumber, 100},
+    {"effect", ParamEffectName, EffectCount - 1},
+    {"speed", ParamNumber, 100},
+    {"t", ParamNumber, UINT16_MAX},
+    {"easing", ParamEasingName, EasingCount - 1},
+    {"length", ParamNumber, UINT16_MAX},
+    {"gap", ParamNumber, 0xfff},
+    {"reverse", ParamNumber, 1},
+    {"output", ParamNumber, 7},
+    {"id", ParamNumber, LED_STRIP_MAX_SCENES - 1},
+    {"name", ParamText, 0},
+    {"segments", ParamText, 0},
+    {"since", ParamNumber, UINT32_MAX}};
+
+// The query of a request after one pass over it. Values of absent parameters are 0, texts point
+// into the request and live as long as it does.
+struct RequestParams
+{
+  uint32_t present;
+  uint32_t values[ParamCount];
+  const char *texts[ParamCount];
+
+  bool Has(RequestParam param) const
+  {
+    return (present & (1UL << param)) != 0;
+  }
+
+  uint32_t Get(RequestParam param) const
+  {
+    return values[param];
+  }
+
+  const char *GetText(RequestParam param) const
+  {
+    return Has(param) ? texts[param] : "";
+  }
+};
+
+// Body of a /state response: the state version, the segment count and one BatchUpdate per
+// segment with every field set, little endian.
+struct StateHeader
+{
+  uint32_t version;
+  uint16_t count;
+} __attribute__((packed));
+
+inline StoredSegmentState PackSegmentState(const StripSegmentState &state)
+{
+  StoredSegmentState stored = {};
+  stored.valid = 1;
+  stored.onOff = state.onOff != 0;
+  stored.hue = state.hue;
+  stored.saturation = state.saturation;
+  stored.brightness = state.brightness;
+  stored.effect = state.effect;
+  stored.speed = state.speed;
+  stored.transition = state.transition > UINT16_MAX ? UINT16_MAX : state.transition;
+  stored.easing = state.easing;
+  return stored;
+}
+
+inline StripSegmentState UnpackSegmentState(unsigned int index, const StoredSegmentState &stored)
+{
+  StripSegmentState state;
+  state.index = index;
+  state.onOff = stored.onOff;
+  state.hue = stored.hue;
+  state.saturation = stored.saturation;
+  state.brightness = stored.brightness;
+  state.effect = stored.effect;
+  state.speed = stored.speed;
+  state.transition = stored.transition;
+  state.easing = stored.easing;
+  return state;
+}
+
+// Newest state of every segment, published by the web handlers and picked up by the renderer.
+typedef StateMailbox<StripSegmentState, MaxSegmentCount> StripStateMailbox;
+
+typedef SceneStore<MaxSegmentCount, LED_STRIP_MAX_SCENES> StripSceneStore;
+
+struct RenderStatistics
+{
+  unsigned int frameRate;
+  unsigned long frames;
+  unsigned long overruns;
+  unsigned long droppedFrames;
+  unsigned long lastFrameMicros;
+  unsigned long maxFrameMicros;
 };
 
 struct StripSegment
 {
   unsigned int index;
   unsigned int lenght;
+  unsigned int gap;
+  unsigned int reversed;
+  unsigned int output;
 };
 
 class WebDriver
 {
 public:
+  // Segments start from the defaults, states restored from flash are set before Init() so the
+  // first request already sees them.
   WebDriver()
   {
-  }
-
-  void Init(QueueHandle_t stripCommandQueue, QueueHandle_t stripConfigQueue)
-  {
-    _stripCommandQueue = stripCommandQueue;
-    _stripConfigQueue = stripConfigQueue;
-
-    for (unsigned int i = 0; i < 10; i++)
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
     {
       _stripState[i].onOff = 1;
       _stripState[i].brightness = 100;
       _stripState[i].saturation = 100;
       _stripState[i].hue = 225;
+      _stripState[i].effect = EffectSolid;
+      _stripState[i].speed = 50;
+      _stripState[i].transition = LED_STRIP_TRANSITION_MILLIS;
+      _stripState[i].easing = EasingInOut;
       _stripState[i].index = i;
     }
+  }
 
+  void Init(StripStateMailbox *stripStateMailbox, QueueHandle_t stripConfigQueue)
+  {
+    _stripStateMailbox = stripStateMailbox;
+    _stripConfigQueue = stripConfigQueue;
+
+    _eventMailbox.Begin();
     _webServer = new AsyncWebServer(80);
 
-    _webServer->on("/status", [&](AsyncWebServerRequest *request)
+    // Every route but /batch, which needs a body handler, parses its query once before it runs.
+    static const Route routes[] = {
+        {"/status", false, &WebDriver::HandleStatus},
+        {"/on", true, &WebDriver::HandleOn},
+        {"/off", true, &WebDriver::HandleOff},
+        {"/hue", false, &WebDriver::HandleHue},
+        {"/saturation", false, &WebDriver::HandleSaturation},
+        {"/brightness", false, &WebDriver::HandleBrightness},
+        {"/effect", false, &WebDriver::HandleEffect},
+        {"/state", false, &WebDriver::HandleState},
+        {"/stats", false, &WebDriver::HandleStats},
+        {"/log", false, &WebDriver::HandleLog},
+        {"/set", true, &WebDriver::HandleSet},
+        {"/stripconfig", true, &WebDriver::HandleStripConfig},
+        {"/scenes", false, &WebDriver::HandleScenes},
+        {"/scene", true, &WebDriver::HandleScene},
+        {"/savescene", true, &WebDriver::HandleSaveScene},
+        {"/deletescene", true, &WebDriver::HandleDeleteScene}};
+    for (const Route &route : routes)
     {
-      request->send(200, "text/plain", String(_stripState[GetIndex(request)].onOff));
-    });
+      const Route *entry = &route;
+      _webServer->on(route.path, [this, entry](AsyncWebServerRequest *request)
+      {
+        HandleRoute(*entry, request);
+      });
+    }
 
-    _webServer->on("/on", [&](AsyncWebServerRequest *request)
+    // Applies a body of BatchUpdate records as one transaction, all of them or none when one is
+    // invalid. The body arrives in chunks on the network task and is copied into one buffer, a
+    // second batch arriving meanwhile is answered with 503 unless the first one stalled.
+    _webServer->on("/batch", HTTP_POST, [&](AsyncWebServerRequest *request)
     {
-      Serial.println("Received a On command.");
-      int segmentIndex = GetIndex(request);
-      _stripState[segmentIndex].onOff = 1;
-      xQueueSend(_stripCommandQueue, &_stripState[GetIndex(request)], portMAX_DELAY);
-      request->send(200, "text/plain", "Strip segment " + String(segmentIndex) + " was turned on.");
-    });
+      bool owner = _batchOwner == request;
+      if (owner)
+      {
+        _batchOwner = NULL;
+      }
 
-    _webServer->on("/off", [&](AsyncWebServerRequest *request)
+      size_t length = request->contentLength();
+      if (length > sizeof(_batchBody))
+      {
+        request->send(413);
+        return;
+      }
+      if (length == 0 || length % sizeof(BatchUpdate) != 0)
+      {
+        request->send(400);
+        return;
+      }
+      if (!Admit(request))
+      {
+        return;
+      }
+      if (!owner)
+      {
+        _admission.Reject();
+        SendRetry(request, 503);
+        return;
+      }
+
+      if (!ApplyBatch(_batchBody, length / sizeof(BatchUpdate)))
+      {
+        request->send(400);
+        return;
+      }
+      request->send(200);
+    }, NULL, [&](AsyncWebServerRequest *request, uint8_t *data, size_t length, size_t index, size_t total)
     {
-      Serial.println("Received a Off command.");
-      int segmentIndex = GetIndex(request);
-      _stripState[segmentIndex].onOff = 0;
-      xQueueSend(_stripCommandQueue, &_stripState[GetIndex(request)], portMAX_DELAY);
+      if (total > sizeof(_batchBody) || index + length > total)
+      {
+        return;
+      }
 
-      request->send(200, "text/plain", "Strip segment " + String(segmentIndex) + " was turned off.");
+      if (index == 0 && (_batchOwner == NULL || millis() - _batchStartMillis > BatchTimeoutMillis))
+      {
+        _batchOwner = request;
+        _batchStartMillis = millis();
+      }
+      if (_batchOwner == request)
+      {
+        memcpy(_batchBody + index, data, length);
+      }
     });
 
-    _webServer->on("/hue", [&](AsyncWebServerRequest *request)
+    // Binary control channel for clients streaming changes, e.g. while a slider moves. A set is
+    // applied like a batch, a segment changing faster than frames go out only shows its newest
+    // state.
+    _webSocket = new AsyncWebSocket("/ws");
+    _webSocket->onEvent([&](AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t length)
     {
-      request->send(200, "text/plain", String(_stripState[GetIndex(request)].hue));
+      if (type == WS_EVT_CONNECT)
+      {
+        server->cleanupClients();
+      }
+      else if (type == WS_EVT_DATA)
+      {
+        OnSocketMessage(client, (const AwsFrameInfo *)arg, data, length);
+      }
     });
+    _webServer->addHandler(_webSocket);
 
-    _webServer->on("/saturation", [&](AsyncWebServerRequest *request)
+    // Pushes every change of a segment state as a "state" event. The data holds one record per
+    // changed segment, separated by ';': index, on/off, hue, saturation, brightness, effect, speed,
+    // transition and easing. The event id is the state version, a client resuming with the
+    // current version missed nothing, any other one gets every segment first.
+    _events = new AsyncEventSource("/events");
+    _events->onConnect([&](AsyncEventSourceClient *client)
     {
-      request->send(200, "text/plain", String(_stripState[GetIndex(request)].saturation));
+      if (client->lastId() != _stateVersion)
+      {
+        SendSnapshot(client);
+      }
     });
+    _webServer->addHandler(_events);
+
+    _sceneStore.Begin();
+    _webServer->begin();
+
+    xTaskCreate(
+        PushLoop,          /* Task function. */
+        "StatePush",       /* String with name of task. */
+        3000,              /* Stack size in words. */
+        this,              /* Parameter passed as input of the task */
+        1,                 /* Priority of the task. */
+        NULL);             /* Task handle. */
+  }
 
-    _webServer->on("/brightness", [&](AsyncWebServerRequest *request)
+  // Commands are taken or turned down right away, the network task never waits for room. A
+  // client over its own rate gets 429, a controller busy with all clients together 503.
+  bool Admit(AsyncWebServerRequest *request)
+  {
+    Admission admission = _admission.Admit(request->client()->remoteIP(), millis());
+    if (admission != Admitted)
     {
-      request->send(200, "text/plain", String(_stripState[GetIndex(request)].brightness));
-    });
+      SendRetry(request, admission == ClientLimited ? 429 : 503);
+      return false;
+    }
+    return true;
+  }
 
-    _webServer->on("/set", [&](AsyncWebServerRequest *request)
-    {      
-      if (request->hasParam("h"))
+  static void SendRetry(AsyncWebServerRequest *request, int code)
+  {
+    AsyncWebServerResponse *response = request->beginResponse(code);
+    response->addHeader("Retry-After", "1");
+    request->send(response);
+  }
+
+  // Every change to a segment state goes out through here, so the version counts them all.
+  void PublishState(unsigned int index)
+  {
+    _stateVersion++;
+    _stripStateMailbox->Publish(index, _stripState[index]);
+    _eventMailbox.Publish(index, _stripState[index]);
+  }
+
+  // Waits for a change and gives the changes of one frame time to pile up, they go out as one
+  // event with only the newest state of each segment.
+  static void PushLoop(void *parameter)
+  {
+    WebDriver *driver = (WebDriver *)parameter;
+    SemaphoreHandle_t signal = driver->_eventMailbox.GetSignal();
+    while (1)
+    {
+      xSemaphoreTake(signal, portMAX_DELAY);
+      vTaskDelay(pdMS_TO_TICKS(1000 / LED_STRIP_FRAME_RATE));
+      xSemaphoreTake(signal, 0);
+      driver->PushChanges();
+    }
+  }
+
+  // Runs on the push task. The AsyncEventSource build in platformio.ini locks its client list
+  // itself, sending here while the network task adds or drops clients is safe. Each task formats
+  // into a buffer of its own.
+  void PushChanges()
+  {
+    // Read before the states are taken. A state newer than the id at most costs a resuming
+    // client a snapshot, an id newer than the states would lose it a change.
+    uint32_t version = _stateVersion;
+    StripSegmentState state;
+    size_t length = 0;
+    while (_eventMailbox.Receive(state))
+    {
+      length = AppendEventRecord(_pushBuffer, state, length);
+    }
+    if (length > 0 && _events->count() > 0)
+    {
+      _events->send(_pushBuffer, "state", version);
+    }
+  }
+
+  // Runs on the network task.
+  void SendSnapshot(AsyncEventSourceClient *client)
+  {
+    uint32_t version = _stateVersion;
+    size_t length = 0;
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
+    {
+      length = AppendEventRecord(_snapshotBuffer, _stripState[i], length);
+    }
+    client->send(_snapshotBuffer, "state", version);
+  }
+
+  // Values are clamped to the widths of a BatchUpdate, which bounds the length of a record.
+  static size_t AppendEventRecord(char *buffer, const StripSegmentState &state, size_t length)
+  {
+    BatchUpdate update = ToBatchUpdate(state);
+    int written = snprintf(buffer + length, EventBufferLength - length, "%s%u %u %u %u %u %u %u %u %u",
+                           length > 0 ? ";" : "", update.index, update.onOff, update.hue, update.saturation, update.brightness,
+                           update.effect, update.speed, update.transition, update.easing);
+    return written > 0 ? length + written : length;
+  }
+
+  // The buffer is only rebuilt when the version moved since the last response. It is rebuilt in
+  // the other of the two buffers, one still going out to a client is never written. While both
+  // are, the last version built is served again, its header tells the client which one it got.
+  uint8_t SerializeState()
+  {
+    uint8_t index = _stateBufferIndex ^ 1;
+    if (_statePins[index] > 0)
+    {
+      index = _stateBufferIndex;
+    }
+    if (_serializedVersion == _stateVersion || _statePins[index] > 0)
+    {
+      return _stateBufferIndex;
+    }
+
+    StateHeader header = {_stateVersion, MaxSegmentCount};
+    memcpy(_stateBuffers[index], &header, sizeof(StateHeader));
+    uint8_t *record = _stateBuffers[index] + sizeof(StateHeader);
+    for (unsigned int i = 0; i < MaxSegmentCount; i++, record += sizeof(BatchUpdate))
+    {
+      BatchUpdate update = ToBatchUpdate(_stripState[i]);
+      memcpy(record, &update, sizeof(BatchUpdate));
+    }
+    _serializedVersion = header.version;
+    _stateBufferIndex = index;
+    return index;
+  }
+
+  // Validates every record before any of them is applied.
+  static bool IsValidUpdate(const BatchUpdate &update)
+  {
+    return update.index < MaxSegmentCount &&
+           (!(update.fields & BatchHue) || update.hue <= RequestParamRules[ParamHue].max) &&
+           (!(update.fields & BatchSaturation) || update.saturation <= RequestParamRules[ParamSaturation].max) &&
+           (!(update.fields & BatchBrightness) || update.brightness <= RequestParamRules[ParamBrightness].max) &&
+           (!(update.fields & BatchEffect) || update.effect <= RequestParamRules[ParamEffect].max) &&
+           (!(update.fields & BatchSpeed) || update.speed <= RequestParamRules[ParamSpeed].max) &&
+           (!(update.fields & BatchEasing) || update.easing <= RequestParamRules[ParamEasing].max);
+  }
+
+  bool ApplyBatch(const uint8_t *records, uint16_t count)
+  {
+    BatchUpdate update;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      memcpy(&update, records + i * sizeof(BatchUpdate), sizeof(BatchUpdate));
+      if (!IsValidUpdate(update))
       {
-        _stripState[GetIndex(request)].hue = request->getParam("h")->value().toInt();
+        return false;
       }
+    }
 
-      if (request->hasParam("s"))
+    StripStateMailbox::Transaction transaction(*_stripStateMailbox);
+    for (uint16_t i = 0; i < count; i++)
+    {
+      memcpy(&update, records + i * sizeof(BatchUpdate), sizeof(BatchUpdate));
+      StripSegmentState &state = _stripState[update.index];
+      if (update.fields & BatchOnOff)
+      {
+        state.onOff = update.onOff != 0;
+      }
+      if (update.fields & BatchHue)
+      {
+        state.hue = update.hue;
+      }
+      if (update.fields & BatchSaturation)
+      {
+        state.saturation = update.saturation;
+      }
+      if (update.fields & BatchBrightness)
+      {
+        state.brightness = update.brightness;
+      }
+      if (update.fields & BatchEffect)
+      {
+        state.effect = update.effect;
+      }
+      if (update.fields & BatchSpeed)
+      {
+        state.speed = update.speed;
+      }
+      if (update.fields & BatchTransition)
+      {
+        state.transition = update.transition;
+      }
+      if (update.fields & BatchEasing)
       {
-        _stripState[GetIndex(request)].saturation = request->getParam("s")->value().toInt();
+        state.easing = update.easing;
       }
+      PublishState(update.index);
+    }
+    return true;
+  }
+
+  void OnSocketMessage(AsyncWebSocketClient *client, const AwsFrameInfo *info, const uint8_t *data, size_t length)
+  {
+    // Messages are a few records, fragmented ones are not expected.
+    if (!info->final || info->index != 0 || info->len != length || info->opcode != WS_BINARY || length == 0)
+    {
+      SendSocketError(client, length > 0 ? data[0] : 0);
+      return;
+    }
 
-      if (request->hasParam("b"))
+    const uint8_t *payload = data + 1;
+    size_t payloadLength = length - 1;
+    switch (data[0])
+    {
+    case SocketSet:
+      if (_admission.Admit(client->remoteIP(), millis()) != Admitted)
       {
-        _stripState[GetIndex(request)].brightness = request->getParam("b")->value().toInt();
-      }      
-      
-      xQueueSend(_stripCommandQueue, &_stripState[GetIndex(request)], portMAX_DELAY);
-      request->send(200);
-    });
+        uint8_t message[] = {SocketRetry, SocketSet};
+        client->binary(message, sizeof(message));
+      }
+      else if (payloadLength == 0 || payloadLength % sizeof(BatchUpdate) != 0 || payloadLength > MaxSegmentCount * sizeof(BatchUpdate) ||
+          !ApplyBatch(payload, payloadLength / sizeof(BatchUpdate)))
+      {
+        SendSocketError(client, SocketSet);
+      }
+      break;
 
-    _webServer->on("/stripconfig", [&](AsyncWebServerRequest *request)
+    case SocketQuery:
     {
-      if (request->hasParam("length"))
+      uint16_t count = payloadLength == 0 ? MaxSegmentCount : payloadLength / sizeof(uint16_t);
+      if (payloadLength % sizeof(uint16_t) != 0 || count > MaxSegmentCount)
       {
-        StripSegment segment;
-        segment.index = GetIndex(request);
-        segment.lenght = request->getParam("length")->value().toInt();
-        
-        xQueueSend(_stripConfigQueue, &segment, portMAX_DELAY);
-        request->send(200, "text/plain", "Segment(" + String(segment.index) + ") was set to " + String(segment.lenght) + " of lenght.");
+        SendSocketError(client, SocketQuery);
+        break;
       }
-      else
+
+      _socketBuffer[0] = SocketState;
+      uint8_t *record = _socketBuffer + 1;
+      for (uint16_t i = 0; i < count; i++, record += sizeof(BatchUpdate))
       {
-        request->send(400);
+        uint16_t index = i;
+        if (payloadLength > 0)
+        {
+          memcpy(&index, payload + i * sizeof(uint16_t), sizeof(uint16_t));
+        }
+        if (index >= MaxSegmentCount)
+        {
+          SendSocketError(client, SocketQuery);
+          return;
+        }
+
+        BatchUpdate update = ToBatchUpdate(_stripState[index]);
+        memcpy(record, &update, sizeof(BatchUpdate));
       }
-    });
+      client->binary(_socketBuffer, record - _socketBuffer);
+      break;
+    }
 
-    _webServer->begin();
+    default:
+      SendSocketError(client, data[0]);
+    }
+  }
+
+  static void SendSocketError(AsyncWebSocketClient *client, uint8_t type)
+  {
+    uint8_t message[] = {SocketError, type};
+    client->binary(message, sizeof(message));
+  }
+
+  static BatchUpdate ToBatchUpdate(const StripSegmentState &state)
+  {
+    BatchUpdate update;
+    update.index = state.index;
+    update.fields = BatchOnOff | BatchHue | BatchSaturation | BatchBrightness | BatchEffect | BatchSpeed | BatchTransition | BatchEasing;
+    update.hue = state.hue;
+    update.transition = state.transition > UINT16_MAX ? UINT16_MAX : state.transition;
+    update.onOff = state.onOff;
+    update.saturation = state.saturation;
+    update.brightness = state.brightness;
+    update.effect = state.effect;
+    update.speed = state.speed;
+    update.easing = state.easing;
+    return update;
   }
 
-  unsigned int GetIndex(AsyncWebServerRequest *request)
+  // Seeds what the routes report and build on, e.g. with the state restored at boot.
+  void SetSegmentState(const StripSegmentState &state)
   {
-    if (request->hasParam("index"))
+    if (state.index < MaxSegmentCount)
     {
-      return request->getParam("index")->value().toInt();
+      _stripState[state.index] = state;
+      _stateVersion++;
+    }
+  }
+
+  void SetRenderStatistics(const RenderStatistics *renderStatistics)
+  {
+    _renderStatistics = renderStatistics;
+  }
+
+protected:
+  typedef void (WebDriver::*RouteHandler)(AsyncWebServerRequest *request, const RequestParams &params);
+
+  struct Route
+  {
+    const char *path;
+    // Commands count against the command rate of the client.
+    bool command;
+    RouteHandler handler;
+  };
+
+  void HandleRoute(const Route &route, AsyncWebServerRequest *request)
+  {
+    if (route.command && !Admit(request))
+    {
+      return;
+    }
+
+    RequestParams params;
+    if (!ParseParams(request, params))
+    {
+      request->send(400);
+      return;
+    }
+    (this->*route.handler)(request, params);
+  }
+
+  // One pass over the query, every known parameter is checked against its rule and unknown ones
+  // are ignored. False as soon as one value is invalid.
+  static bool ParseParams(AsyncWebServerRequest *request, RequestParams &params)
+  {
+    memset(&params, 0, sizeof(RequestParams));
+    size_t count = request->params();
+    for (size_t i = 0; i < count; i++)
+    {
+      const AsyncWebParameter *param = request->getParam(i);
+      for (uint8_t rule = 0; rule < ParamCount; rule++)
+      {
+        if (strcmp(param->name().c_str(), RequestParamRules[rule].name) == 0)
+        {
+          if (!ParseValue(RequestParamRules[rule], param->value().c_str(), params.values[rule]))
+          {
+            return false;
+          }
+          params.texts[rule] = param->value().c_str();
+          params.present |= 1UL << rule;
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  static bool ParseValue(const ParamRule &rule, const char *text, uint32_t &value)
+  {
+    if (rule.kind == ParamText)
+    {
+      return true;
+    }
+
+    const char *const *names = rule.kind == ParamEffectName ? SegmentEffectNames : rule.kind == ParamEasingName ? TransitionEasingNames : NULL;
+    for (uint32_t i = 0; names != NULL && i <= rule.max; i++)
+    {
+      if (strcmp(text, names[i]) == 0)
+      {
+        value = i;
+        return true;
+      }
+    }
+
+    char *end;
+    unsigned long number = strtoul(text, &end, 10);
+    if (text[0] < '0' || text[0] > '9' || *end != '\0' || number > rule.max)
+    {
+      return false;
+    }
+    value = number;
+    return true;
+  }
+
+  // Text answers are formatted into _responseText and sent with SendBody().
+  size_t AppendText(size_t length, const char *format, ...) __attribute__((format(printf, 3, 4)))
+  {
+    va_list arguments;
+    va_start(arguments, format);
+    int written = vsnprintf(_responseText + length, sizeof(_responseText) - length, format, arguments);
+    va_end(arguments);
+    length += written > 0 ? written : 0;
+    return length < sizeof(_responseText) ? length : sizeof(_responseText) - 1;
+  }
+
+  void SendText(AsyncWebServerRequest *request)
+  {
+    static const String contentType("text/plain");
+    SendBody(request, contentType, (const uint8_t *)_responseText, strlen(_responseText));
+  }
+
+  // A body this short leaves together with the headers in the first write to the socket, so
+  // send_P() can read it from a shared buffer. A longer one can take several acks to go out while
+  // the next request already reuses the buffer, it is copied into the response instead.
+  static void SendBody(AsyncWebServerRequest *request, const String &contentType, const uint8_t *content, size_t length)
+  {
+    if (length <= InPlaceBodyLength)
+    {
+      request->send_P(200, contentType, content, length);
+      return;
+    }
+
+    AsyncResponseStream *response = request->beginResponseStream(contentType, length);
+    response->write(content, length);
+    request->send(response);
+  }
+
+  void HandleStatus(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    AppendText(0, "%u", _stripState[params.Get(ParamIndex)].onOff);
+    SendText(request);
+  }
+
+  void HandleOn(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    unsigned int index = params.Get(ParamIndex);
+    LOG_INFO(LogSegmentOn, index);
+    _stripState[index].onOff = 1;
+    PublishState(index);
+    AppendText(0, "Strip segment %u was turned on.", index);
+    SendText(request);
+  }
+
+  void HandleOff(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    unsigned int index = params.Get(ParamIndex);
+    LOG_INFO(LogSegmentOff, index);
+    _stripState[index].onOff = 0;
+    PublishState(index);
+    AppendText(0, "Strip segment %u was turned off.", index);
+    SendText(request);
+  }
+
+  void HandleHue(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    AppendText(0, "%u", _stripState[params.Get(ParamIndex)].hue);
+    SendText(request);
+  }
+
+  void HandleSaturation(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    AppendText(0, "%u", _stripState[params.Get(ParamIndex)].saturation);
+    SendText(request);
+  }
+
+  void HandleBrightness(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    AppendText(0, "%u", _stripState[params.Get(ParamIndex)].brightness);
+    SendText(request);
+  }
+
+  void HandleEffect(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    request->send_P(200, "text/plain", SegmentEffectNames[_stripState[params.Get(ParamIndex)].effect]);
+  }
+
+  // Every segment in one response for clients polling the whole controller. A client passing the
+  // version it already has in since gets 304 as long as nothing changed.
+  void HandleState(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    if (params.Has(ParamSince) && params.Get(ParamSince) == _stateVersion)
+    {
+      request->send(304);
+      return;
+    }
+
+    // Too long to be kept inside a String, built once instead of per request.
+    static const String contentType("application/octet-stream");
+    // The buffer stays pinned until the client is gone, the response is read from it in place.
+    uint8_t index = SerializeState();
+    _statePins[index]++;
+    request->onDisconnect([this, index]()
+                          { _statePins[index]--; });
+    request->send_P(200, contentType, _stateBuffers[index], sizeof(_stateBuffers[index]));
+  }
+
+  void HandleStats(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    if (_renderStatistics == NULL)
+    {
+      request->send(404);
+      return;
+    }
+
+    AppendText(0, "fps %u\nframes %lu\noverruns %lu\ndropped_frames %lu\nlast_frame_us %lu\nmax_frame_us %lu\n"
+                  "commands_accepted %u\ncommands_coalesced %u\ncommands_rejected %u",
+               _renderStatistics->frameRate, _renderStatistics->frames, _renderStatistics->overruns,
+               _renderStatistics->droppedFrames, _renderStatistics->lastFrameMicros, _renderStatistics->maxFrameMicros, (unsigned int)_admission.GetAccepted(),
+               (unsigned int)_stripStateMailbox->GetCoalescedCount(), (unsigned int)_admission.GetRejected());
+    SendText(request);
+  }
+
+  // The whole event log is too long for the text buffer, it is still built as a String.
+  void HandleLog(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    EventLog &eventLog = EventLog::Instance();
+    EventLog::Reader reader(eventLog.GetOldest());
+    LogEvent event;
+    char line[160];
+    String log;
+    while (eventLog.Read(reader, event))
+    {
+      EventLog::Format(event, line, sizeof(line));
+      log += line;
+      log += "\n";
+    }
+    if (reader.lost > 0)
+    {
+      snprintf(line, sizeof(line), "%u events were overwritten while reading\n", (unsigned int)reader.lost);
+      log += line;
+    }
+    request->send(200, "text/plain", log);
+  }
+
+  void HandleSet(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    static const struct
+    {
+      RequestParam param;
+      unsigned int StripSegmentState::*field;
+    } fields[] = {
+        {ParamHue, &StripSegmentState::hue},
+        {ParamSaturation, &StripSegmentState::saturation},
+        {ParamBrightness, &StripSegmentState::brightness},
+        {ParamEffect, &StripSegmentState::effect},
+        {ParamSpeed, &StripSegmentState::speed},
+        {ParamTransition, &StripSegmentState::transition},
+        {ParamEasing, &StripSegmentState::easing}};
+
+    StripSegmentState &state = _stripState[params.Get(ParamIndex)];
+    for (const auto &field : fields)
+    {
+      if (params.Has(field.param))
+      {
+        state.*field.field = params.Get(field.param);
+      }
+    }
+    PublishState(state.index);
+    request->send(200);
+  }
+
+  void HandleStripConfig(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    if (!params.Has(ParamLength))
+    {
+      request->send(400);
+      return;
+    }
+
+    StripSegment segment;
+    segment.index = params.Get(ParamIndex);
+    segment.lenght = params.Get(ParamLength);
+    segment.gap = params.Get(ParamGap);
+    segment.reversed = params.Get(ParamReverse);
+    segment.output = params.Get(ParamOutput);
+
+    // Handlers run on the network task, a configuration still being applied is reported
+    // instead of waited for.
+    if (!xQueueSend(_stripConfigQueue, &segment, 0))
+    {
+      _admission.Reject();
+      SendRetry(request, 503);
+      return;
+    }
+    AppendText(0, "Segment(%u) was set to %u of lenght.", segment.index, segment.lenght);
+    SendText(request);
+  }
+
+  void HandleScenes(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    size_t length = 0;
+    _responseText[0] = '\0';
+    for (uint8_t id = 0; id < StripSceneStore::SceneCount; id++)
+    {
+      if (_sceneStore.IsUsed(id))
+      {
+        length = AppendText(length, "%u %s %u\n", id, _sceneStore.GetName(id), _sceneStore.GetSegmentCount(id));
+      }
+    }
+    SendText(request);
+  }
+
+  // Recalls a scene by id or name, t overrides the transition of every segment in it.
+  void HandleScene(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    int id = GetSceneId(params);
+    if (id < 0 || !_sceneStore.Load(id, _scene))
+    {
+      request->send(404);
+      return;
+    }
+
+    // Published as one transaction, the whole scene goes out in a single frame.
+    {
+      StripStateMailbox::Transaction transaction(*_stripStateMailbox);
+      for (unsigned int i = 0; i < MaxSegmentCount; i++)
+      {
+        if (_scene.Contains(i))
+        {
+          _stripState[i] = UnpackSegmentState(i, _scene.states[i]);
+          if (params.Has(ParamTransition))
+          {
+            _stripState[i].transition = params.Get(ParamTransition);
+          }
+          PublishState(i);
+        }
+      }
+    }
+    AppendText(0, "Scene %s was recalled.", _sceneStore.GetName(id));
+    SendText(request);
+  }
+
+  // Snapshots the current state of every segment, or of the comma separated ones in segments,
+  // into the scene with that id or name.
+  void HandleSaveScene(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    const char *name = params.GetText(ParamName);
+    int id = params.Has(ParamId) ? (int)params.Get(ParamId) : _sceneStore.Find(name);
+    if (id < 0)
+    {
+      id = _sceneStore.FindFree();
+    }
+    if (name[0] == '\0' || id < 0 || id >= StripSceneStore::SceneCount)
+    {
+      request->send(400);
+      return;
+    }
+
+    _scene.Clear();
+    if (params.Has(ParamSegments))
+    {
+      const char *segments = params.GetText(ParamSegments);
+      while (*segments != '\0')
+      {
+        char *end;
+        unsigned long index = strtoul(segments, &end, 10);
+        if (end == segments || index >= MaxSegmentCount || (*end != ',' && *end != '\0'))
+        {
+          request->send(400);
+          return;
+        }
+        _scene.Add(index, PackSegmentState(_stripState[index]));
+        segments = *end == ',' ? end + 1 : end;
+      }
     }
     else
     {
-      return 0;
+      for (unsigned int i = 0; i < MaxSegmentCount; i++)
+      {
+        _scene.Add(i, PackSegmentState(_stripState[i]));
+      }
+    }
+
+    // Every write slot is taken, the scene can be saved again once the flush task caught up.
+    if (!_sceneStore.Save(id, name, _scene))
+    {
+      SendRetry(request, 503);
+      return;
     }
+    AppendText(0, "%d", id);
+    SendText(request);
+  }
+
+  void HandleDeleteScene(AsyncWebServerRequest *request, const RequestParams &params)
+  {
+    int id = GetSceneId(params);
+    if (id < 0)
+    {
+      request->send(404);
+      return;
+    }
+    if (!_sceneStore.Remove(id))
+    {
+      SendRetry(request, 503);
+      return;
+    }
+    request->send(200);
+  }
+
+  // Scene from its id or name parameter, -1 when it does not exist.
+  int GetSceneId(const RequestParams &params)
+  {
+    if (params.Has(ParamId))
+    {
+      return _sceneStore.IsUsed(params.Get(ParamId)) ? (int)params.Get(ParamId) : -1;
+    }
+    if (params.Has(ParamName))
+    {
+      return _sceneStore.Find(params.GetText(ParamName));
+    }
+    return -1;
   }
 
-protected:
   AsyncWebServer *_webServer;
+  AsyncWebSocket *_webSocket;
+  AsyncEventSource *_events;
+  const RenderStatistics *_renderStatistics = NULL;
   unsigned int _id;
-  QueueHandle_t _stripCommandQueue;
+  StripStateMailbox *_stripStateMailbox;
   QueueHandle_t _stripConfigQueue;
   unsigned int _onOffState = 0;
-  StripSegmentState _stripState[10];
+  StripSegmentState _stripState[MaxSegmentCount];
+  static const unsigned long BatchTimeoutMillis = 2000;
+  uint8_t _batchBody[MaxSegmentCount * sizeof(BatchUpdate)];
+  AsyncWebServerRequest *_batchOwner = NULL;
+  unsigned long _batchStartMillis = 0;
+  uint8_t _socketBuffer[1 + MaxSegmentCount * sizeof(BatchUpdate)];
+  // Starts above the serialized version so the first /state builds the buffer. Only the network
+  // task changes it, the push task reads it.
+  std::atomic<uint32_t> _stateVersion{1};
+  uint32_t _serializedVersion = 0;
+  uint8_t _stateBuffers[2][sizeof(StateHeader) + MaxSegmentCount * sizeof(BatchUpdate)];
+  uint8_t _stateBufferIndex = 0;
+  // Responses still reading each buffer, only touched on the network task.
+  uint16_t _statePins[2] = {};
+  // Changes not pushed yet, the text of pushed events and that of snapshots.
+  static const size_t EventBufferLength = MaxSegmentCount * sizeof("65535 255 65535 255 255 255 255 65535 255;");
+  StripStateMailbox _eventMailbox;
+  char _pushBuffer[EventBufferLength];
+  char _snapshotBuffer[EventBufferLength];
+  AdmissionControl _admission;
+  static const size_t ResponseTextLength = 256 + StripSceneStore::SceneCount * 32;
+  static const size_t InPlaceBodyLength = 256;
+  char _responseText[ResponseTextLength];
+  StripSceneStore _sceneStore;
+  StripSceneStore::Scene _scene;
 };
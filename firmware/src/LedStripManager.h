@@ -1,33 +1,67 @@
 #pragma once
 
 #include <LedStripDriver.h>
-#include <Preferences.h>
-
-const int MaxSegments = 10; 
+#include <EffectEngine.h>
+#include <RealtimeReceiver.h>
+#include <freertos/timers.h>
+#include "SettingsStore.h"
 
 class LedStripManager
 {
 public:
-  const static char* PreferenceNamespace;
-
   LedStripManager()
   {
   }
 
-  void Init(QueueHandle_t stripCommandQueue, QueueHandle_t stripConfigQueue, LedStripDriver *ledStripDriver)
+  void Init(StripStateMailbox *stripStateMailbox, QueueHandle_t stripConfigQueue, LedStripDriver *ledStripDriver, RealtimeReceiver *realtimeReceiver)
   {
-    _stripCommandQueue = stripCommandQueue;
+    _stripStateMailbox = stripStateMailbox;
     _stripConfigQueue = stripConfigQueue;
     _ledStripDriver = ledStripDriver;
+    _realtimeReceiver = realtimeReceiver;
 
-    RestoreSegmentConfiguration();
+    // Queues have to be empty when they join the set, nothing has been sent to them yet.
+    _frameTick = xSemaphoreCreateBinary();
+    _events = xQueueCreateSet(4);
+    xQueueAddToSet(_stripStateMailbox->GetSignal(), _events);
+    xQueueAddToSet(_stripConfigQueue, _events);
+    xQueueAddToSet(_frameTick, _events);
+    xQueueAddToSet(_realtimeReceiver->GetFrameSignal(), _events);
+    // The frame timer never ticks faster than the outputs can take frames.
+    _effectEngine.LimitFrameRate(_ledStripDriver->GetFrameMicros());
+    _frameTimer = xTimerCreate("LedStripFrame", _effectEngine.GetFramePeriod(), pdTRUE, NULL, OnFrameTimer);
+
+    _ledStripDriver->SetOutputReadyHandler(OnOutputReady);
+    _ledStripDriver->Begin();
+    _settingsStore.Begin();
+    RestoreSettings();
     StartLoop();
   }
 
+  // The state the segment was left in before the last reboot, false if it never had one.
+  bool GetSegmentState(unsigned int index, StripSegmentState &state)
+  {
+    return _settingsStore.GetSegmentState(index, state);
+  }
+
+  const RenderStatistics *GetRenderStatistics()
+  {
+    return _effectEngine.GetStatistics();
+  }
+
 private:
-  static QueueHandle_t _stripCommandQueue;
+  static StripStateMailbox *_stripStateMailbox;
   static QueueHandle_t _stripConfigQueue;
   static LedStripDriver *_ledStripDriver;
+  static RealtimeReceiver *_realtimeReceiver;
+  static bool _realtimeActive;
+  static unsigned long _lastRealtimeMillis;
+  static EffectEngine _effectEngine;
+  static SettingsStore _settingsStore;
+  static QueueSetHandle_t _events;
+  static SemaphoreHandle_t _frameTick;
+  static TimerHandle_t _frameTimer;
+  static unsigned long _lastRenderMillis;
 
   void StartLoop()
   {
@@ -40,96 +74,183 @@ private:
         NULL);                 /* Task handle. */
   }
 
-  void RestoreSegmentConfiguration()
+  // Segments that never received a state stay white so a fresh strip shows it is powered.
+  void RestoreSettings()
   {
-    int configurations[MaxSegments];
-    ReadSegmentConfigurations(configurations);
-    
-    for(size_t i = 0; i < MaxSegments; i++)
+    StripSegment configurations[MaxSegmentCount];
+    _settingsStore.GetSegments(configurations);
+    _ledStripDriver->ConfigureSegments(configurations, MaxSegmentCount);
+    _ledStripDriver->SetFullStripColor(White);
+
+    StripSegmentState state;
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
     {
-      StripSegment segment;
-      segment.index = i;
-      segment.lenght = configurations[i];
-      _ledStripDriver->ConfigureSegment(segment);
+      if (_settingsStore.GetSegmentState(i, state))
+      {
+        _effectEngine.SetSegmentState(state);
+      }
     }
-
-    _ledStripDriver->SetFullStripColor(White);
+    // Also starts the frame timer when a restored effect animates.
+    RenderFrame();
   }
 
+  // Sleeps until a segment state, a configuration or a frame tick arrives. States are rendered and
+  // committed right away, frame ticks only run while something animates or once the output task
+  // can take a frame it turned away.
+  // States published as one transaction, e.g. a scene, always land in the same frame.
+  // While a realtime stream runs its frames are shown instead, segment states are kept and
+  // rendered again once the stream stops.
   static void Loop(void *parameter)
   {
     StripSegmentState _receivedState;
     StripSegment _receivedSegment;
     while (1)
     {
-      if (xQueueReceive(_stripCommandQueue, &_receivedState, 0))
+      QueueSetMemberHandle_t event = xQueueSelectFromSet(_events, _realtimeActive ? pdMS_TO_TICKS(LED_STRIP_REALTIME_TIMEOUT_MILLIS) : portMAX_DELAY);
+
+      if (event == _stripStateMailbox->GetSignal() && xSemaphoreTake(event, 0))
+      {
+        // Only the newest state of each segment is left, whatever came in between is dropped.
+        while (_stripStateMailbox->Receive(_receivedState))
+        {
+          LOG_INFO(LogStripCommand, _receivedState.index, _receivedState.hue, _receivedState.saturation, _receivedState.brightness, _receivedState.effect);
+          _effectEngine.SetSegmentState(_receivedState);
+          _settingsStore.SetSegmentState(_receivedState);
+        }
+      }
+      else if (event == _stripConfigQueue && xQueueReceive(_stripConfigQueue, &_receivedSegment, 0))
       {
-        Serial.println("StripManager: Received new strip command: H " + String(_receivedState.hue) + " S " + String(_receivedState.saturation) + " B " + String(_receivedState.brightness));
-        if (_receivedState.onOff == 0)
+        LOG_INFO(LogStripConfiguration, _receivedSegment.index, _receivedSegment.lenght);
+        if (_ledStripDriver->ConfigureSegment(_receivedSegment))
         {
-          _ledStripDriver->SetSegmentColor(_receivedState.index, Zero);
+          _settingsStore.SetSegment(_receivedSegment);
         }
-        else
+      }
+      else if (event == _frameTick)
+      {
+        xSemaphoreTake(_frameTick, 0);
+        // Pixels the output task turned away go out as rendered, the next tick renders again.
+        if (!_realtimeActive && _ledStripDriver->HasPendingFrame())
+        {
+          _ledStripDriver->CommitFrame();
+          continue;
+        }
+      }
+      else if (event == _realtimeReceiver->GetFrameSignal() && xSemaphoreTake(event, 0))
+      {
+        ShowRealtimeFrame();
+      }
+
+      if (_realtimeActive)
+      {
+        if (millis() - _lastRealtimeMillis < LED_STRIP_REALTIME_TIMEOUT_MILLIS)
         {
-          HsbColor color(_receivedState.hue / 360.0f, _receivedState.saturation/100.0f, _receivedState.brightness/100.f);
-          _ledStripDriver->SetSegmentColor(_receivedState.index, color);
+          CommitRealtimeFrame();
+          continue;
         }
+        ResumeSegments();
       }
 
-      if (xQueueReceive(_stripConfigQueue, &_receivedSegment, 0))
+      // The rest of a transaction is still coming, its commit wakes the loop again.
+      if (!_stripStateMailbox->IsSettled())
       {
-        Serial.println("StripManager: Received new strip configuration: Index " + String(_receivedSegment.index) + " Length " + String(_receivedSegment.lenght));
-        SaveSegmentConfguration(_receivedSegment);
-        _ledStripDriver->ConfigureSegment(_receivedSegment);        
+        continue;
       }
 
-      delay(50);
+      RenderFrame();
     }
   }
 
-  static void SaveSegmentConfguration(StripSegment stripSegment)
+  static void RenderFrame()
   {
-    char segmentKey[10];
-    sprintf(segmentKey, "segment%d", stripSegment.index);
+    // Animations only advance while the frame timer runs, a command arriving after an idle
+    // period starts from where everything stopped.
+    unsigned long now = millis();
+    bool ticking = xTimerIsTimerActive(_frameTimer);
+    unsigned long frameStart = micros();
+    bool pending = _ledStripDriver->HasPendingFrame();
+    _effectEngine.Render(_ledStripDriver, ticking ? now - _lastRenderMillis : 0);
+    _ledStripDriver->CommitFrame();
+    _effectEngine.RecordFrame(micros() - frameStart, pending);
+    _lastRenderMillis = now;
 
-    Preferences preferences;
-    preferences.begin(PreferenceNamespace);
-    preferences.putUInt(segmentKey, stripSegment.lenght);
-    preferences.end();
+    // A frame the output task could not take yet goes out once it reports itself ready.
+    bool needsTicks = _effectEngine.IsAnimating();
+    if (needsTicks && !ticking)
+    {
+      xTimerStart(_frameTimer, 0);
+    }
+    else if (!needsTicks && ticking)
+    {
+      xTimerStop(_frameTimer, 0);
+    }
   }
 
-  static unsigned int ReadSegmentConfiguration(int index)
+  static void ShowRealtimeFrame()
   {
-    char segmentKey[10];
-    sprintf(segmentKey, "segment%d", index);
-
-    Preferences preferences;
-    preferences.begin(PreferenceNamespace);
-    unsigned int length = preferences.getUInt(segmentKey, 0);
-    preferences.end();
+    const RgbwColor *pixels = _realtimeReceiver->TakeFrame();
+    if (pixels == NULL)
+    {
+      return;
+    }
 
-    return length;
+    if (!_realtimeActive)
+    {
+      LOG_INFO(LogRealtimeStarted);
+      _realtimeActive = true;
+    }
+    _ledStripDriver->SetPixels(pixels, _realtimeReceiver->GetPixelCount());
+    _lastRealtimeMillis = millis();
   }
 
-  static void ReadSegmentConfigurations(int configurations[])
+  // A frame the output task could not take yet goes out once it reports itself ready.
+  static void CommitRealtimeFrame()
   {
-    char segmentKey[10];
-    Preferences preferences;
-    preferences.begin(PreferenceNamespace);
+    _ledStripDriver->CommitFrame();
+    if (xTimerIsTimerActive(_frameTimer))
+    {
+      xTimerStop(_frameTimer, 0);
+    }
+  }
 
-    for (unsigned int i = 0; i < MaxSegments; i++)
+  // Draws the segments over what the stream left, the way RestoreSettings() does at boot.
+  static void ResumeSegments()
+  {
+    LOG_INFO(LogRealtimeStopped);
+    _realtimeActive = false;
+    _ledStripDriver->SetFullStripColor(Zero);
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
     {
-      sprintf(segmentKey, "segment%d", i);
-      unsigned int length = preferences.getUInt(segmentKey, 0);
-      configurations[i] = length;
-    }    
-    
-    preferences.end();
+      if (_ledStripDriver->GetSegment(i).length > 0 && !_effectEngine.HasSegmentState(i))
+      {
+        _ledStripDriver->SetSegmentColor(i, White);
+      }
+    }
+    _effectEngine.Invalidate();
+    xTimerStop(_frameTimer, 0);
+  }
+
+  static void OnFrameTimer(TimerHandle_t timer)
+  {
+    xSemaphoreGive(_frameTick);
+  }
+
+  // Runs on the output task, the frame tick wakes the loop to commit what is pending.
+  static void OnOutputReady()
+  {
+    xSemaphoreGive(_frameTick);
   }
 };
 
-QueueHandle_t LedStripManager::_stripCommandQueue;
+StripStateMailbox *LedStripManager::_stripStateMailbox;
 QueueHandle_t LedStripManager::_stripConfigQueue;
 LedStripDriver *LedStripManager::_ledStripDriver;
-
-const char* LedStripManager::PreferenceNamespace = "segment-config";
+RealtimeReceiver *LedStripManager::_realtimeReceiver;
+bool LedStripManager::_realtimeActive;
+unsigned long LedStripManager::_lastRealtimeMillis;
+EffectEngine LedStripManager::_effectEngine;
+SettingsStore LedStripManager::_settingsStore;
+QueueSetHandle_t LedStripManager::_events;
+SemaphoreHandle_t LedStripManager::_frameTick;
+TimerHandle_t LedStripManager::_frameTimer;
+unsigned long LedStripManager::_lastRenderMillis;
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <LedStripDriver.h>
+#include <Preferences.h>
+
+// How long the settings have to stay unchanged before they are written, and how long a stream
+// of changes may hold a write back at most.
+#ifndef SETTINGS_FLUSH_DELAY_MILLIS
+#define SETTINGS_FLUSH_DELAY_MILLIS 2000
+#endif
+
+#ifndef SETTINGS_FLUSH_MAX_DELAY_MILLIS
+#define SETTINGS_FLUSH_MAX_DELAY_MILLIS 10000
+#endif
+
+// Everything that survives a reboot, written as a single NVS blob. The arrays hold segmentCount
+// entries each, the CRC covers everything before it.
+struct StripSettings
+{
+  uint16_t version;
+  uint16_t segmentCount;
+  uint32_t segments[MaxSegmentCount];
+  StoredSegmentState states[MaxSegmentCount];
+  uint32_t crc;
+};
+
+// Keeps the settings in RAM and writes them from its own task once they settle, so a burst of
+// changes costs one flash write and the render loop never waits for flash.
+class SettingsStore
+{
+public:
+  const static char *PreferenceNamespace;
+  const static uint16_t SettingsVersion = 1;
+
+  // Reads the blob, or the per-segment keys written before it existed, and starts the flush task.
+  void Begin()
+  {
+    if (!ReadSettings(_settings))
+    {
+      _legacyKeysPending = ReadLegacySettings(_settings);
+    }
+    _lastWrittenCrc = _settings.crc;
+
+    xTaskCreate(
+        FlushLoop,         /* Task function. */
+        "SettingsFlush",   /* String with name of task. */
+        3000,              /* Stack size in words. */
+        this,              /* Parameter passed as input of the task */
+        0,                 /* Priority of the task. */
+        &_flushTask);      /* Task handle. */
+
+    // Settings that were migrated or resized are written back in the current layout.
+    if (_lastWrittenCrc != Crc32((const uint8_t *)&_settings, offsetof(StripSettings, crc)))
+    {
+      ScheduleFlush();
+    }
+  }
+
+  void GetSegments(StripSegment segments[])
+  {
+    portENTER_CRITICAL(&_lock);
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
+    {
+      segments[i] = UnpackSegment(i, _settings.segments[i]);
+    }
+    portEXIT_CRITICAL(&_lock);
+  }
+
+  // False when no state was stored for the segment yet.
+  bool GetSegmentState(unsigned int index, StripSegmentState &state)
+  {
+    if (index >= MaxSegmentCount)
+    {
+      return false;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    StoredSegmentState stored = _settings.states[index];
+    portEXIT_CRITICAL(&_lock);
+
+    state = UnpackSegmentState(index, stored);
+    return stored.valid != 0;
+  }
+
+  void SetSegment(const StripSegment &segment)
+  {
+    if (segment.index >= MaxSegmentCount)
+    {
+      return;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    _settings.segments[segment.index] = PackSegment(segment);
+    portEXIT_CRITICAL(&_lock);
+    ScheduleFlush();
+  }
+
+  void SetSegmentState(const StripSegmentState &state)
+  {
+    if (state.index >= MaxSegmentCount)
+    {
+      return;
+    }
+
+    StoredSegmentState stored = PackSegmentState(state);
+    portENTER_CRITICAL(&_lock);
+    _settings.states[state.index] = stored;
+    portEXIT_CRITICAL(&_lock);
+    ScheduleFlush();
+  }
+
+protected:
+  void ScheduleFlush()
+  {
+    if (_flushTask != NULL)
+    {
+      xTaskNotifyGive(_flushTask);
+    }
+  }
+
+  // Waits for the first change, then for a quiet period, and writes the blob unless it ends up
+  // identical to what is already in flash.
+  static void FlushLoop(void *parameter)
+  {
+    SettingsStore *store = (SettingsStore *)parameter;
+    while (1)
+    {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      TickType_t firstChange = xTaskGetTickCount();
+      while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SETTINGS_FLUSH_DELAY_MILLIS)) != 0 &&
+             xTaskGetTickCount() - firstChange < pdMS_TO_TICKS(SETTINGS_FLUSH_MAX_DELAY_MILLIS))
+      {
+      }
+
+      StripSettings settings;
+      portENTER_CRITICAL(&store->_lock);
+      settings = store->_settings;
+      portEXIT_CRITICAL(&store->_lock);
+
+      settings.crc = Crc32((const uint8_t *)&settings, offsetof(StripSettings, crc));
+      if (settings.crc != store->_lastWrittenCrc && WriteSettings(settings))
+      {
+        store->_lastWrittenCrc = settings.crc;
+      }
+
+      // The old keys stay until the blob holding what was migrated from them is in flash.
+      if (store->_legacyKeysPending && settings.crc == store->_lastWrittenCrc)
+      {
+        RemoveLegacySettings();
+        store->_legacyKeysPending = false;
+      }
+    }
+  }
+
+  // A blob written by a build with a different LED_STRIP_MAX_SEGMENTS keeps the segments both
+  // builds have in common.
+  static bool ReadSettings(StripSettings &settings)
+  {
+    Preferences preferences;
+    preferences.begin(PreferenceNamespace, true);
+    size_t length = preferences.getBytesLength("settings");
+    uint8_t *blob = length >= BlobSize(0) ? new uint8_t[length] : NULL;
+    bool read = blob != NULL && preferences.getBytes("settings", blob, length) == length;
+    preferences.end();
+
+    uint16_t version = 0;
+    uint16_t segmentCount = 0;
+    uint32_t crc = 0;
+    if (read)
+    {
+      memcpy(&version, blob, sizeof(version));
+      memcpy(&segmentCount, blob + sizeof(version), sizeof(segmentCount));
+      memcpy(&crc, blob + length - sizeof(crc), sizeof(crc));
+      read = version == SettingsVersion && length == BlobSize(segmentCount) && crc == Crc32(blob, length - sizeof(crc));
+    }
+
+    if (read)
+    {
+      uint16_t count = segmentCount < MaxSegmentCount ? segmentCount : MaxSegmentCount;
+      memset(&settings, 0, sizeof(StripSettings));
+      settings.version = SettingsVersion;
+      settings.segmentCount = MaxSegmentCount;
+      memcpy(settings.segments, blob + offsetof(StripSettings, segments), count * sizeof(uint32_t));
+      memcpy(settings.states, blob + offsetof(StripSettings, segments) + segmentCount * sizeof(uint32_t), count * sizeof(StoredSegmentState));
+      settings.crc = segmentCount == MaxSegmentCount ? crc : 0;
+    }
+    else
+    {
+      LOG_WARN(LogSettingsInvalid);
+    }
+
+    delete[] blob;
+    return read;
+  }
+
+  static constexpr size_t BlobSize(uint16_t segmentCount)
+  {
+    return offsetof(StripSettings, segments) + segmentCount * (sizeof(uint32_t) + sizeof(StoredSegmentState)) + sizeof(uint32_t);
+  }
+
+  static bool WriteSettings(const StripSettings &settings)
+  {
+    Preferences preferences;
+    preferences.begin(PreferenceNamespace);
+    bool written = preferences.putBytes("settings", &settings, sizeof(StripSettings)) == sizeof(StripSettings);
+    preferences.end();
+    if (written)
+    {
+      LOG_INFO(LogSettingsWritten);
+    }
+    return written;
+  }
+
+  // Segment configurations used to be stored one key per segment, states were not stored.
+  // Returns true when any key was found.
+  static bool ReadLegacySettings(StripSettings &settings)
+  {
+    memset(&settings, 0, sizeof(StripSettings));
+    settings.version = SettingsVersion;
+    settings.segmentCount = MaxSegmentCount;
+
+    char segmentKey[12];
+    bool found = false;
+    Preferences preferences;
+    preferences.begin(PreferenceNamespace, true);
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
+    {
+      sprintf(segmentKey, "segment%u", i);
+      uint32_t packedSegment = preferences.getUInt(segmentKey, 0);
+      found = found || packedSegment != 0;
+      settings.segments[i] = MigrateLegacySegment(i, packedSegment);
+    }
+    preferences.end();
+    return found;
+  }
+
+  // Keys written before outputs existed hold a 15 bit gap where the output now sits. A set bit
+  // there that names an output this build cannot have marks such a key; its gap is cut to the
+  // 12 bits the current layout keeps, gaps that long never fit an output anyway.
+  static uint32_t MigrateLegacySegment(unsigned int index, uint32_t packedSegment)
+  {
+    uint32_t output = (packedSegment >> 28) & 0x7;
+    if (output < LedStripDriver::MaxOutputCount)
+    {
+      return packedSegment;
+    }
+
+    uint32_t gap = (packedSegment >> 16) & 0x7fff;
+    LOG_WARN(LogSettingsGapClamped, gap, index, 0xfff);
+    return (packedSegment & 0xffff) | (0xfffu << 16) | (packedSegment & 0x80000000);
+  }
+
+  static void RemoveLegacySettings()
+  {
+    char segmentKey[12];
+    Preferences preferences;
+    preferences.begin(PreferenceNamespace);
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
+    {
+      sprintf(segmentKey, "segment%u", i);
+      preferences.remove(segmentKey);
+    }
+    preferences.end();
+  }
+
+  static uint32_t Crc32(const uint8_t *data, size_t length)
+  {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < length; i++)
+    {
+      crc ^= data[i];
+      for (uint8_t bit = 0; bit < 8; bit++)
+      {
+        crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+      }
+    }
+    return ~crc;
+  }
+
+  // Length in the low 16 bits keeps values written before gaps, direction and outputs existed readable.
+  static uint32_t PackSegment(const StripSegment &stripSegment)
+  {
+    return (stripSegment.lenght & 0xffff) | ((stripSegment.gap & 0xfff) << 16) | ((stripSegment.output & 0x7) << 28) | ((stripSegment.reversed ? 1u : 0u) << 31);
+  }
+
+  static StripSegment UnpackSegment(unsigned int index, uint32_t packedSegment)
+  {
+    StripSegment segment;
+    segment.index = index;
+    segment.lenght = packedSegment & 0xffff;
+    segment.gap = (packedSegment >> 16) & 0xfff;
+    segment.output = (packedSegment >> 28) & 0x7;
+    segment.reversed = packedSegment >> 31;
+    return segment;
+  }
+
+  StripSettings _settings;
+  uint32_t _lastWrittenCrc = 0;
+  bool _legacyKeysPending = false;
+  TaskHandle_t _flushTask = NULL;
+  portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+const char *SettingsStore::PreferenceNamespace = "segment-config";
@@ -6,23 +6,37 @@
 #define LED_STRIP_PIN 17
 #endif
 
-LedStripDriver ledStripDriver(LED_STRIP_PIN);
+// Extra data pins driven in parallel with the main one, e.g. -DLED_STRIP_EXTRA_PINS=16,4,2
+#ifdef LED_STRIP_EXTRA_PINS
+const uint8_t ledStripPins[] = {LED_STRIP_PIN, LED_STRIP_EXTRA_PINS};
+#else
+const uint8_t ledStripPins[] = {LED_STRIP_PIN};
+#endif
+
+LedStripDriver ledStripDriver(ledStripPins, sizeof(ledStripPins));
 WebDriver webDriver;
 StatusLedDriver statusLedDriver;
 LedStripManager ledStripManager;
-QueueHandle_t stripCommandQueue;
+StripStateMailbox stripStateMailbox;
+RealtimeReceiver realtimeReceiver;
 QueueHandle_t stripConfigQueue;
 
 void setup()
 {
     Serial.begin(115200);
+    EventLog::Instance().Begin();
     InitializeCommandQueues();
     InitializeBasicDrivers();
 
+    // The strip runs on its own tasks from here on, it shows the last state while WiFi is
+    // still associating or the config portal is open.
+    InitializeStrip();
+
     SetBoardState(SeekingWifi);
     InitializeWifi();
     SetBoardState(WifiConnected);
-    InitializeDrivers();
+    InitializeWebDriver();
+    realtimeReceiver.Begin();
     SetBoardState(Ready);
 }
 
@@ -32,8 +46,9 @@ void loop()
 
 void InitializeCommandQueues()
 {
-    stripCommandQueue = xQueueCreate(1, sizeof(StripSegmentState));
+    stripStateMailbox.Begin();
     stripConfigQueue = xQueueCreate(1, sizeof(StripSegment));
+    realtimeReceiver.Init(ledStripDriver.GetOutputCount() * LedStripDriver::MaxPixelCount);
 }
 
 void InitializeBasicDrivers()
@@ -41,10 +56,25 @@ void InitializeBasicDrivers()
     statusLedDriver.Init();
 }
 
-void InitializeDrivers()
+void InitializeStrip()
+{
+    ledStripManager.Init(&stripStateMailbox, stripConfigQueue, &ledStripDriver, &realtimeReceiver);
+}
+
+void InitializeWebDriver()
 {
-    ledStripManager.Init(stripCommandQueue, stripConfigQueue, &ledStripDriver);
-    webDriver.Init(stripCommandQueue, stripConfigQueue);
+    webDriver.SetRenderStatistics(ledStripManager.GetRenderStatistics());
+
+    StripSegmentState state;
+    for (unsigned int i = 0; i < MaxSegmentCount; i++)
+    {
+        if (ledStripManager.GetSegmentState(i, state))
+        {
+            webDriver.SetSegmentState(state);
+        }
+    }
+
+    webDriver.Init(&stripStateMailbox, stripConfigQueue);
 }
 
 void InitializeWifi()
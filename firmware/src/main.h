@@ -18,6 +18,7 @@ enum BoardState
 
 void InitializeCommandQueues();
 void InitializeBasicDrivers();
-void InitializeDrivers();
+void InitializeStrip();
+void InitializeWebDriver();
 void InitializeWifi();
 void SetBoardState(BoardState boardState);
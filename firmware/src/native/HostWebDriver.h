@@ -0,0 +1,30 @@
+#pragma once
+
+#include <WebDriver.h>
+
+// Feeds requests to the routes WebDriver registered, without a socket.
+class HostWebDriver : public WebDriver
+{
+public:
+  int Request(const char *url, const uint8_t *body = NULL, size_t bodyLength = 0)
+  {
+    AsyncWebServerRequest request(url, body, bodyLength);
+    Dispatch(request);
+    return request.responseCode();
+  }
+
+  AsyncWebSocket *GetWebSocket()
+  {
+    return _webSocket;
+  }
+
+  AsyncEventSource *GetEventSource()
+  {
+    return _events;
+  }
+
+  void Dispatch(AsyncWebServerRequest &request)
+  {
+    _webServer->Dispatch(request);
+  }
+};
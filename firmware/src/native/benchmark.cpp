@@ -0,0 +1,474 @@
+// Micro-benchmarks of the firmware hot paths, run on the host:
+//
+//   pio run -e bench && .pio/build/bench/program [filter]
+//
+// Only names containing filter are run. Times are host times, compare runs of the same machine
+// before and after a change. Allocations are the operator new calls of the benchmark thread.
+
+// The request paths are timed including admission, at rates that never turn a request down.
+#define LED_STRIP_CLIENT_COMMAND_RATE 100000000
+#define LED_STRIP_CLIENT_COMMAND_BURST 1000000
+#define LED_STRIP_COMMAND_RATE 100000000
+#define LED_STRIP_COMMAND_BURST 1000000
+
+#include <Arduino.h>
+#include <LedStripDriver.h>
+#include <EffectEngine.h>
+#include <RealtimeReceiver.h>
+#include <WiFiManager.h>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include "HostWebDriver.h"
+
+static thread_local uint64_t allocations = 0;
+
+// Every form of new and delete is replaced, so each pointer goes back to the allocator it
+// came from.
+static void *Allocate(size_t size, size_t alignment)
+{
+  allocations++;
+  size = size > 0 ? size : 1;
+  void *pointer = alignment > alignof(std::max_align_t) ? aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : malloc(size);
+  if (pointer == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return pointer;
+}
+
+void *operator new(size_t size)
+{
+  return Allocate(size, 0);
+}
+
+void *operator new[](size_t size)
+{
+  return Allocate(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+  return Allocate(size, (size_t)alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+  return Allocate(size, (size_t)alignment);
+}
+
+void operator delete(void *pointer) noexcept
+{
+  free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+  free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+  free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+  free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept
+{
+  free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t) noexcept
+{
+  free(pointer);
+}
+
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept
+{
+  free(pointer);
+}
+
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept
+{
+  free(pointer);
+}
+
+template <typename T>
+static void KeepAlive(const T &value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Times batches of growing size until one takes long enough to be measured. Frame benchmarks
+// pause the clock while they wait for the output task.
+class Benchmark
+{
+public:
+  void Pause()
+  {
+    _pausedAt = Now();
+  }
+
+  void Resume()
+  {
+    _paused += Now() - _pausedAt;
+  }
+
+  template <typename T_BODY>
+  void Run(const char *name, T_BODY body)
+  {
+    if (_filter != NULL && strstr(name, _filter) == NULL)
+    {
+      return;
+    }
+
+    body(*this);
+    uint64_t iterations = 1;
+    while (true)
+    {
+      _paused = 0;
+      uint64_t allocationsBefore = allocations;
+      int64_t start = Now();
+      for (uint64_t i = 0; i < iterations; i++)
+      {
+        body(*this);
+      }
+      int64_t elapsed = Now() - start - _paused;
+      uint64_t allocated = allocations - allocationsBefore;
+
+      if (elapsed >= MinimumBatchNanos || iterations >= (1ULL << 30))
+      {
+        printf("%-36s %10llu %12.1f %10.2f\n", name, (unsigned long long)iterations,
+               (double)elapsed / iterations, (double)allocated / iterations);
+        return;
+      }
+      iterations = elapsed <= 0 ? iterations * 10 : iterations * MinimumBatchNanos / elapsed + iterations;
+    }
+  }
+
+  void SetFilter(const char *filter)
+  {
+    _filter = filter;
+  }
+
+protected:
+  static const int64_t MinimumBatchNanos = 200000000;
+
+  static int64_t Now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  const char *_filter = NULL;
+  int64_t _paused = 0;
+  int64_t _pausedAt = 0;
+};
+
+// A driver with pixelCount pixels spread over four segments, on as many outputs as needed.
+static LedStripDriver *CreateDriver(uint16_t pixelCount)
+{
+  static uint8_t pins[LedStripDriver::MaxOutputCount] = {0, 1, 2, 3};
+  uint8_t outputCount = (pixelCount + LedStripDriver::MaxPixelCount - 1) / LedStripDriver::MaxPixelCount;
+  LedStripDriver *driver = new LedStripDriver(pins, outputCount);
+  driver->Begin();
+
+  StripSegment segments[4];
+  for (unsigned int i = 0; i < 4; i++)
+  {
+    segments[i].index = i;
+    segments[i].lenght = pixelCount / 4;
+    segments[i].gap = 0;
+    segments[i].reversed = i % 2;
+    segments[i].output = i * outputCount / 4;
+  }
+  driver->ConfigureSegments(segments, 4);
+  return driver;
+}
+
+static StripSegmentState SegmentState(unsigned int index, uint8_t effect)
+{
+  StripSegmentState state = {};
+  state.index = index;
+  state.onOff = 1;
+  state.hue = 40 + index * 90;
+  state.saturation = 100;
+  state.brightness = 80;
+  state.effect = effect;
+  state.speed = 50;
+  state.transition = 0;
+  state.easing = EasingInOut;
+  return state;
+}
+
+static void FrameBenchmarks(Benchmark &benchmark, uint16_t pixelCount)
+{
+  LedStripDriver *driver = CreateDriver(pixelCount);
+  for (uint8_t effect : {(uint8_t)EffectRainbow, (uint8_t)EffectTwinkle, (uint8_t)EffectSolid})
+  {
+    EffectEngine *engine = new EffectEngine();
+    for (unsigned int i = 0; i < 4; i++)
+    {
+      engine->SetSegmentState(SegmentState(i, effect));
+    }
+
+    char name[48];
+    snprintf(name, sizeof(name), "frame/%s/%u", SegmentEffectNames[effect], pixelCount);
+    benchmark.Run(name, [&](Benchmark &benchmark)
+    {
+      benchmark.Pause();
+      while (driver->IsOutputBusy())
+      {
+        std::this_thread::yield();
+      }
+      benchmark.Resume();
+
+      engine->Render(driver, 20);
+      driver->CommitFrame();
+    });
+  }
+}
+
+static void SegmentBenchmarks(Benchmark &benchmark)
+{
+  LedStripDriver *driver = CreateDriver(600);
+  uint16_t length = driver->GetSegment(1).length;
+
+  benchmark.Run("segment/fill/150", [&](Benchmark &)
+  {
+    driver->SetSegmentColor(1, Candle);
+  });
+
+  benchmark.Run("segment/pixels/150", [&](Benchmark &)
+  {
+    for (uint16_t offset = 0; offset < length; offset++)
+    {
+      driver->SetSegmentPixelColor(1, offset, Candle);
+    }
+  });
+
+  benchmark.Run("segment/full-strip/600", [&](Benchmark &)
+  {
+    driver->SetFullStripColor(White);
+  });
+}
+
+static void ColorBenchmarks(Benchmark &benchmark)
+{
+  uint8_t levels[256];
+  ColorPipeline::BuildLevelTable(200, levels);
+  uint16_t hue = 0;
+
+  benchmark.Run("color/hsb-to-rgbw", [&](Benchmark &)
+  {
+    KeepAlive(ColorPipeline::Apply(levels, ColorPipeline::HueToRgbw(hue, 180)));
+    hue += 97;
+  });
+
+  benchmark.Run("color/hue-to-rgbw", [&](Benchmark &)
+  {
+    KeepAlive(ColorPipeline::HueToRgbw(hue, 180));
+    hue += 97;
+  });
+
+  uint8_t brightness = 0;
+  benchmark.Run("color/level-table", [&](Benchmark &)
+  {
+    ColorPipeline::BuildLevelTable(brightness++, levels);
+    KeepAlive(levels);
+  });
+}
+
+static void LogBenchmarks(Benchmark &benchmark)
+{
+  unsigned int hue = 0;
+  benchmark.Run("log/record", [&](Benchmark &)
+  {
+    LOG_INFO(LogStripCommand, 3, hue++ % 360, 100, 80, EffectRainbow);
+  });
+}
+
+static void WebBenchmarks(Benchmark &benchmark)
+{
+  static StripStateMailbox stripStateMailbox;
+  stripStateMailbox.Begin();
+  static QueueHandle_t stripConfigQueue = xQueueCreate(1, sizeof(StripSegment));
+  static RenderStatistics statistics = {};
+  HostWebDriver *webDriver = new HostWebDriver();
+  webDriver->SetRenderStatistics(&statistics);
+  webDriver->Init(&stripStateMailbox, stripConfigQueue);
+
+  // The query is parsed by the web server before the route runs, only the route is timed.
+  const char *urls[][2] = {
+      {"web/set/hsb", "/set?index=3&h=120&s=80&b=60"},
+      {"web/set/effect", "/set?index=3&effect=rainbow&speed=70&t=500&easing=out"},
+      {"web/stripconfig", "/stripconfig?index=2&length=120&gap=3&output=0"},
+      {"web/hue", "/hue?index=3"},
+      {"web/stats", "/stats"},
+      {"web/state", "/state"},
+  };
+  StripSegmentState state;
+  for (auto &url : urls)
+  {
+    AsyncWebServerRequest request(url[1]);
+    benchmark.Run(url[0], [&](Benchmark &)
+    {
+      webDriver->Dispatch(request);
+      while (stripStateMailbox.Receive(state))
+      {
+      }
+      xSemaphoreTake(stripStateMailbox.GetSignal(), 0);
+      xQueueReceive(stripConfigQueue, NULL, 0);
+    });
+  }
+
+  // Twenty zones changed at once, as one batch and as a request each.
+  BatchUpdate updates[20];
+  std::vector<AsyncWebServerRequest> setRequests;
+  for (uint16_t i = 0; i < 20; i++)
+  {
+    updates[i] = {i, BatchHue | BatchBrightness | BatchTransition, (uint16_t)(30 + i), 1000, 0, 0, 60, 0, 0, 0};
+    char url[64];
+    snprintf(url, sizeof(url), "/set?index=%u&h=%u&b=60&t=1000", i, 30 + i);
+    setRequests.emplace_back(url);
+  }
+  AsyncWebServerRequest batchRequest("/batch", (const uint8_t *)updates, sizeof(updates));
+  benchmark.Run("web/batch/20", [&](Benchmark &)
+  {
+    webDriver->Dispatch(batchRequest);
+    while (stripStateMailbox.Receive(state))
+    {
+    }
+    xSemaphoreTake(stripStateMailbox.GetSignal(), 0);
+  });
+  benchmark.Run("web/set/20", [&](Benchmark &)
+  {
+    for (AsyncWebServerRequest &request : setRequests)
+    {
+      webDriver->Dispatch(request);
+    }
+    while (stripStateMailbox.Receive(state))
+    {
+    }
+    xSemaphoreTake(stripStateMailbox.GetSignal(), 0);
+  });
+
+  AsyncWebSocket *webSocket = webDriver->GetWebSocket();
+  AsyncWebSocketClient *client = webSocket->Connect();
+  uint8_t setMessage[1 + sizeof(BatchUpdate)] = {SocketSet};
+  memcpy(setMessage + 1, &updates[3], sizeof(BatchUpdate));
+  benchmark.Run("ws/set", [&](Benchmark &)
+  {
+    webSocket->Receive(client, setMessage, sizeof(setMessage));
+    while (stripStateMailbox.Receive(state))
+    {
+    }
+    xSemaphoreTake(stripStateMailbox.GetSignal(), 0);
+  });
+
+  // Sent replies are kept by the host client, dropping them is not timed.
+  uint8_t queryMessage[] = {SocketQuery};
+  benchmark.Run("ws/query/all", [&](Benchmark &benchmark)
+  {
+    webSocket->Receive(client, queryMessage, sizeof(queryMessage));
+    benchmark.Pause();
+    client->TakeMessages();
+    benchmark.Resume();
+  });
+}
+
+// One DDP frame of 1000 RGBW pixels in three packets, decoded into the back buffer and published.
+static void RealtimeBenchmarks(Benchmark &benchmark)
+{
+  static RealtimeReceiver receiver;
+  receiver.Init(1000);
+
+  std::vector<std::vector<uint8_t>> packets;
+  for (uint32_t offset = 0; offset < 4000; offset += 1440)
+  {
+    uint16_t length = 4000 - offset < 1440 ? 4000 - offset : 1440;
+    std::vector<uint8_t> packet(10 + length, 0x42);
+    uint8_t header[10] = {(uint8_t)(offset + length >= 4000 ? 0x41 : 0x40), 0, 0x1b, 1, 0, 0,
+                          (uint8_t)(offset >> 8), (uint8_t)offset, (uint8_t)(length >> 8), (uint8_t)length};
+    memcpy(packet.data(), header, sizeof(header));
+    packets.push_back(packet);
+  }
+
+  benchmark.Run("realtime/ddp/1000", [&](Benchmark &)
+  {
+    for (const std::vector<uint8_t> &packet : packets)
+    {
+      receiver.HandlePacket(RealtimeReceiver::DdpPort, packet.data(), packet.size());
+    }
+    KeepAlive(receiver.TakeFrame());
+    xSemaphoreTake(receiver.GetFrameSignal(), 0);
+  });
+}
+
+// The config portal pages are protected, they are served through the routes the portal binds.
+class PortalPages : public WiFiManager
+{
+public:
+  PortalPages(const char *apName)
+  {
+    server.reset(new WebServer(80));
+    _apName = apName;
+    bindHandler();
+  }
+
+  WebServer &Server()
+  {
+    return *server;
+  }
+};
+
+// WiFiManager::handleRoot and WiFiManager::handleWifi as the firmware starts the portal, with a
+// scan result of eight networks.
+static void WifiManagerBenchmarks(Benchmark &benchmark)
+{
+  WiFi.SetScanResult({{"spectrum-lab", -48, WIFI_AUTH_WPA2_PSK}, {"Livebox-21F0", -55, WIFI_AUTH_WPA2_PSK},
+                      {"guest", -61, WIFI_AUTH_OPEN}, {"FRITZ!Box 7590", -67, WIFI_AUTH_WPA2_PSK},
+                      {"iot", -70, WIFI_AUTH_WPA_WPA2_PSK}, {"Workshop", -74, WIFI_AUTH_WPA2_PSK},
+                      {"TP-Link_5G", -80, WIFI_AUTH_WPA2_PSK}, {"backstage", -86, WIFI_AUTH_OPEN}});
+  PortalPages portal("LED Controller 305419896");
+
+  benchmark.Run("wifimanager/root-page", [&](Benchmark &)
+  {
+    portal.Server().SetRequest("/");
+    portal.Server().Dispatch();
+    KeepAlive(portal.Server().ResponseContent().length());
+  });
+
+  benchmark.Run("wifimanager/wifi-page", [&](Benchmark &)
+  {
+    portal.Server().SetRequest("/wifi");
+    portal.Server().Dispatch();
+    KeepAlive(portal.Server().ResponseContent().length());
+  });
+}
+
+int main(int argc, char **argv)
+{
+  Serial.setMuted(true);
+  SimulatedWire::Recording() = false;
+  SimulatedWire::Timing().bitNanos = 0;
+  SimulatedWire::Timing().resetMicros = 0;
+
+  Benchmark benchmark;
+  benchmark.SetFilter(argc > 1 ? argv[1] : NULL);
+
+  printf("%-36s %10s %12s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+  SegmentBenchmarks(benchmark);
+  ColorBenchmarks(benchmark);
+  FrameBenchmarks(benchmark, 100);
+  FrameBenchmarks(benchmark, 600);
+  FrameBenchmarks(benchmark, 2000);
+  LogBenchmarks(benchmark);
+  WebBenchmarks(benchmark);
+  RealtimeBenchmarks(benchmark);
+  WifiManagerBenchmarks(benchmark);
+  return 0;
+}
@@ -0,0 +1,723 @@
+// Runs the firmware's strip pipeline on the host against the simulated wire and reports what
+// a controller can sustain for a given layout:
+//
+//   pio run -e native && .pio/build/native/program --pixels 1200 --segments 8 --outputs 4
+//
+// Wire time follows the WS2812 timing model of SimulatedWire, render times are host times.
+
+#include <Arduino.h>
+#include <LedStripDriver.h>
+#include "../LedStripManager.h"
+#include "HostWebDriver.h"
+#include <thread>
+
+struct SimulationOptions
+{
+  unsigned int pixels = 600;
+  unsigned int segments = 4;
+  unsigned int outputs = 1;
+  unsigned int seconds = 5;
+  unsigned int commands = 50;
+  unsigned int rate = 60;
+  unsigned int streamRate = 40;
+};
+
+static uint8_t pins[LedStripDriver::MaxOutputCount];
+static StripStateMailbox stripStateMailbox;
+static RealtimeReceiver realtimeReceiver;
+static QueueHandle_t stripConfigQueue;
+static LedStripDriver *ledStripDriver;
+static HostWebDriver webDriver;
+static LedStripManager ledStripManager;
+
+static bool ParseOptions(int argc, char **argv, SimulationOptions &options)
+{
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    unsigned int value = strtoul(argv[i + 1], NULL, 10);
+    if (strcmp(argv[i], "--pixels") == 0)
+      options.pixels = value;
+    else if (strcmp(argv[i], "--segments") == 0)
+      options.segments = value;
+    else if (strcmp(argv[i], "--outputs") == 0)
+      options.outputs = value;
+    else if (strcmp(argv[i], "--seconds") == 0)
+      options.seconds = value;
+    else if (strcmp(argv[i], "--commands") == 0)
+      options.commands = value;
+    else if (strcmp(argv[i], "--rate") == 0)
+      options.rate = value;
+    else if (strcmp(argv[i], "--stream-rate") == 0)
+      options.streamRate = value;
+    else
+      return false;
+  }
+
+  if (options.rate < 1 || options.rate > 1000 || options.streamRate < 1 || options.streamRate > 1000)
+  {
+    fprintf(stderr, "rates must be between 1 and 1000 per second\n");
+    return false;
+  }
+  if (options.outputs < 1 || options.outputs > LedStripDriver::MaxOutputCount)
+  {
+    fprintf(stderr, "outputs must be between 1 and %d\n", LedStripDriver::MaxOutputCount);
+    return false;
+  }
+  if (options.segments < 1 || options.segments > MaxSegmentCount)
+  {
+    fprintf(stderr, "segments must be between 1 and %d\n", MaxSegmentCount);
+    return false;
+  }
+  if (options.segments < options.outputs || (options.pixels + options.outputs - 1) / options.outputs > LedStripDriver::MaxPixelCount)
+  {
+    fprintf(stderr, "each output needs a segment and at most %d pixels (LED_STRIP_MAX_PIXEL_COUNT)\n", LedStripDriver::MaxPixelCount);
+    return false;
+  }
+  return true;
+}
+
+static void Request(const char *format, ...)
+{
+  char url[128];
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(url, sizeof(url), format, arguments);
+  va_end(arguments);
+
+  // A configuration still being applied or a client over its rate is retried, like a client would.
+  int code;
+  while ((code = webDriver.Request(url)) == 503 || code == 429)
+  {
+    delay(1);
+  }
+  if (code != 200)
+  {
+    fprintf(stderr, "request %s failed\n", url);
+    exit(1);
+  }
+}
+
+// Segments are spread round-robin over the outputs, pixels evenly over the segments.
+static void ConfigureLayout(const SimulationOptions &options)
+{
+  for (unsigned int i = 0; i < options.segments; i++)
+  {
+    unsigned int length = options.pixels / options.segments + (i < options.pixels % options.segments ? 1 : 0);
+    Request("/stripconfig?index=%u&length=%u&output=%u", i, length, i % options.outputs);
+  }
+
+  while (uxQueueMessagesWaiting(stripConfigQueue) > 0)
+  {
+    delay(1);
+  }
+  delay(100);
+}
+
+static void MeasureThroughput(const SimulationOptions &options)
+{
+  for (unsigned int i = 0; i < options.segments; i++)
+  {
+    Request("/set?index=%u&effect=rainbow&speed=50&t=0", i);
+  }
+  delay(200);
+
+  SimulatedWire::TakeFrames();
+  const RenderStatistics *statistics = ledStripManager.GetRenderStatistics();
+  unsigned long framesBefore = statistics->frames;
+  unsigned long overrunsBefore = statistics->overruns;
+  unsigned long droppedBefore = statistics->droppedFrames;
+  delay(options.seconds * 1000);
+
+  std::vector<SimulatedFrame> frames = SimulatedWire::TakeFrames();
+  double wireFps = (double)frames.size() / options.outputs / options.seconds;
+  double renderFps = (double)(statistics->frames - framesBefore) / options.seconds;
+
+  printf("Throughput (rainbow on every segment, %u s)\n", options.seconds);
+  printf("  target frame rate       %u fps\n", statistics->frameRate);
+  printf("  rendered                %.1f fps, %lu overruns, %lu dropped\n", renderFps, statistics->overruns - overrunsBefore,
+         statistics->droppedFrames - droppedBefore);
+  printf("  sent on the wire        %.1f fps per output\n", wireFps);
+  printf("  render + commit         last %lu us, max %lu us (host)\n", statistics->lastFrameMicros, statistics->maxFrameMicros);
+}
+
+// Time from the HTTP handler running to the first frame carrying the new color being latched.
+static void MeasureLatency(const SimulationOptions &options)
+{
+  for (unsigned int i = 0; i < options.segments; i++)
+  {
+    Request("/set?index=%u&effect=solid&h=0&s=100&b=100&t=0", i);
+  }
+  delay(200);
+
+  uint8_t segment = 0;
+  const SegmentRange &range = ledStripDriver->GetSegment(segment);
+  uint16_t firstPixel = range.start % LedStripDriver::MaxPixelCount;
+  uint8_t pin = pins[range.output];
+
+  uint8_t levels[256];
+  ColorPipeline::BuildLevelTable(255, levels);
+
+  int64_t total = 0;
+  int64_t worst = 0;
+  unsigned int measured = 0;
+  for (unsigned int i = 0; i < options.commands; i++)
+  {
+    unsigned int hue = i % 2 == 0 ? 120 : 240;
+    RgbwColor rendered = ColorPipeline::Apply(levels, ColorPipeline::HueToRgbw((uint32_t)hue * 65536 / 360, 255));
+    RgbwColor expected = RgbwColor(PixelKernel<LED_STRIP_FEATURE::ColorObject>::Convert(rendered));
+
+    SimulatedWire::TakeFrames();
+    int64_t sent = esp_timer_get_time();
+    Request("/set?index=%u&h=%u&t=0", segment, hue);
+
+    int64_t latched = 0;
+    while (latched == 0 && esp_timer_get_time() - sent < 1000000)
+    {
+      delay(1);
+      for (const SimulatedFrame &frame : SimulatedWire::TakeFrames())
+      {
+        RgbwColor pixel = LED_STRIP_FEATURE::retrievePixelColor(frame.bytes.data(), firstPixel);
+        if (latched == 0 && frame.pin == pin && pixel == expected)
+        {
+          latched = frame.latchedMicros;
+        }
+      }
+    }
+
+    if (latched > 0)
+    {
+      total += latched - sent;
+      worst = latched - sent > worst ? latched - sent : worst;
+      measured++;
+
+      // Frames are recorded when they start, let this one leave the wire and spread the next
+      // command over the frame period.
+      int64_t remaining = latched - esp_timer_get_time();
+      delay((remaining > 0 ? remaining / 1000 + 1 : 0) + i * 7 % 20);
+    }
+  }
+
+  printf("Command latency (/set to pixels latched, %u commands)\n", options.commands);
+  if (measured == 0)
+  {
+    printf("  no command reached the wire\n");
+    return;
+  }
+  printf("  average                 %.2f ms\n", total / 1000.0 / measured);
+  printf("  worst                   %.2f ms\n", worst / 1000.0);
+  if (measured < options.commands)
+  {
+    printf("  lost                    %u\n", options.commands - measured);
+  }
+}
+
+// A WebSocket client moving a hue slider on one segment at a steady rate. An update counts as
+// applied with the first latched frame showing it or a newer one, updates that arrive faster
+// than frames go out are coalesced.
+static void MeasureSocketUpdates(const SimulationOptions &options)
+{
+  const unsigned int HueSteps = 24;
+  Request("/set?index=0&effect=solid&h=0&s=100&b=100&t=0");
+  delay(200);
+
+  uint8_t levels[256];
+  ColorPipeline::BuildLevelTable(255, levels);
+  RgbwColor expected[HueSteps];
+  for (unsigned int step = 0; step < HueSteps; step++)
+  {
+    RgbwColor rendered = ColorPipeline::Apply(levels, ColorPipeline::HueToRgbw((uint32_t)step * 65536 / HueSteps, 255));
+    expected[step] = RgbwColor(PixelKernel<LED_STRIP_FEATURE::ColorObject>::Convert(rendered));
+  }
+
+  AsyncWebSocket *webSocket = webDriver.GetWebSocket();
+  AsyncWebSocketClient *client = webSocket->Connect();
+  unsigned int updates = options.rate * options.seconds;
+  std::vector<int64_t> sent(updates);
+  BatchUpdate update = {0, BatchHue | BatchTransition, 0, 0, 0, 0, 0, 0, 0, 0};
+  uint8_t message[1 + sizeof(BatchUpdate)] = {SocketSet};
+
+  SimulatedWire::TakeFrames();
+  int64_t start = esp_timer_get_time();
+  for (unsigned int i = 0; i < updates; i++)
+  {
+    int64_t due = start + (int64_t)i * 1000000 / options.rate;
+    while (esp_timer_get_time() < due)
+    {
+      delayMicroseconds(200);
+    }
+
+    // Hues are whole steps of 15 degrees, the one on the wire identifies the update.
+    update.hue = (i % HueSteps) * 360 / HueSteps;
+    memcpy(message + 1, &update, sizeof(BatchUpdate));
+    sent[i] = esp_timer_get_time();
+    webSocket->Receive(client, message, sizeof(message));
+  }
+  delay(200);
+  webSocket->Disconnect(client);
+
+  const SegmentRange &range = ledStripDriver->GetSegment(0);
+  uint16_t firstPixel = range.start % LedStripDriver::MaxPixelCount;
+  std::vector<int64_t> started(updates, 0);
+  std::vector<int64_t> applied(updates, 0);
+  unsigned int nextUnapplied = 0;
+  unsigned int frames = 0;
+  for (const SimulatedFrame &frame : SimulatedWire::TakeFrames())
+  {
+    RgbwColor pixel = LED_STRIP_FEATURE::retrievePixelColor(frame.bytes.data(), firstPixel);
+    if (frame.pin != pins[range.output])
+    {
+      continue;
+    }
+    frames++;
+
+    // The newest update with this hue that was sent before the frame went out.
+    int shown = -1;
+    for (int i = updates - 1; i >= 0; i--)
+    {
+      if (sent[i] <= frame.startMicros && pixel == expected[i % HueSteps])
+      {
+        shown = i;
+        break;
+      }
+    }
+    for (; (int)nextUnapplied <= shown; nextUnapplied++)
+    {
+      started[nextUnapplied] = frame.startMicros;
+      applied[nextUnapplied] = frame.latchedMicros;
+    }
+  }
+
+  int64_t totalStarted = 0;
+  int64_t total = 0;
+  int64_t worst = 0;
+  for (unsigned int i = 0; i < nextUnapplied; i++)
+  {
+    totalStarted += started[i] - sent[i];
+    total += applied[i] - sent[i];
+    worst = applied[i] - sent[i] > worst ? applied[i] - sent[i] : worst;
+  }
+
+  printf("WebSocket updates (%u/s on one segment, %u s)\n", options.rate, options.seconds);
+  printf("  frames on the wire      %u\n", frames);
+  if (nextUnapplied == 0)
+  {
+    printf("  no update reached the wire\n");
+    return;
+  }
+  printf("  average to wire         %.2f ms\n", totalStarted / 1000.0 / nextUnapplied);
+  printf("  average to latched      %.2f ms\n", total / 1000.0 / nextUnapplied);
+  printf("  worst to latched        %.2f ms\n", worst / 1000.0);
+  if (nextUnapplied < updates)
+  {
+    printf("  never applied           %u\n", updates - nextUnapplied);
+  }
+}
+
+// Recalls a scene covering every segment, none of the frames on the wire may show only part of it.
+static void MeasureSceneRecall(const SimulationOptions &options)
+{
+  for (unsigned int i = 0; i < options.segments; i++)
+  {
+    Request("/set?index=%u&effect=solid&h=240&s=100&b=100&t=0", i);
+  }
+  Request("/savescene?name=recall");
+  for (unsigned int i = 0; i < options.segments; i++)
+  {
+    Request("/set?index=%u&h=0&t=0", i);
+  }
+  delay(200);
+
+  uint8_t levels[256];
+  ColorPipeline::BuildLevelTable(255, levels);
+  RgbwColor rendered = ColorPipeline::Apply(levels, ColorPipeline::HueToRgbw(240 * 65536 / 360, 255));
+  RgbwColor expected = RgbwColor(PixelKernel<LED_STRIP_FEATURE::ColorObject>::Convert(rendered));
+
+  SimulatedWire::TakeFrames();
+  int64_t sent = esp_timer_get_time();
+  Request("/scene?name=recall&t=0");
+  delay(200);
+
+  unsigned int partialFrames = 0;
+  int64_t latched = 0;
+  for (const SimulatedFrame &frame : SimulatedWire::TakeFrames())
+  {
+    unsigned int segments = 0;
+    unsigned int recalled = 0;
+    for (unsigned int i = 0; i < options.segments; i++)
+    {
+      const SegmentRange &range = ledStripDriver->GetSegment(i);
+      if (pins[range.output] == frame.pin)
+      {
+        segments++;
+        recalled += LED_STRIP_FEATURE::retrievePixelColor(frame.bytes.data(), range.start % LedStripDriver::MaxPixelCount) == expected ? 1 : 0;
+      }
+    }
+
+    if (recalled > 0 && recalled < segments)
+    {
+      partialFrames++;
+    }
+    if (recalled == segments && frame.latchedMicros > latched)
+    {
+      latched = frame.latchedMicros;
+    }
+  }
+
+  printf("Scene recall (/scene over %u segments)\n", options.segments);
+  if (latched == 0)
+  {
+    printf("  the scene never reached the wire\n");
+    return;
+  }
+  printf("  latched on every output %.2f ms\n", (latched - sent) / 1000.0);
+  printf("  partially applied       %u frames\n", partialFrames);
+}
+
+// Every configured segment changed at the given rate while an event client listens. Each event
+// may carry a segment once, the last event of each segment has to show its last change and a
+// client resuming from the last id must not get a snapshot.
+static void MeasureStateEvents(const SimulationOptions &options)
+{
+  AsyncEventSource *events = webDriver.GetEventSource();
+  AsyncEventSourceClient *client = events->Connect();
+  delay(100);
+  std::vector<HostEvent> snapshot = client->TakeEvents();
+
+  unsigned int updates = options.rate * options.seconds;
+  int64_t start = esp_timer_get_time();
+  for (unsigned int i = 0; i < updates; i++)
+  {
+    int64_t due = start + (int64_t)i * 1000000 / options.rate;
+    while (esp_timer_get_time() < due)
+    {
+      delayMicroseconds(200);
+    }
+    for (unsigned int segment = 0; segment < options.segments; segment++)
+    {
+      Request("/set?index=%u&h=%u", segment, (i + segment) % 360);
+    }
+  }
+  delay(200);
+
+  std::vector<HostEvent> pushed = client->TakeEvents();
+  std::vector<int> lastHue(options.segments, -1);
+  unsigned int records = 0;
+  unsigned int repeated = 0;
+  unsigned int unordered = 0;
+  uint32_t lastId = snapshot.empty() ? 0 : snapshot.back().id;
+  for (const HostEvent &event : pushed)
+  {
+    unordered += event.id <= lastId ? 1 : 0;
+    lastId = event.id;
+    std::vector<bool> seen(MaxSegmentCount, false);
+    for (const char *record = event.data.c_str(); *record != '\0';)
+    {
+      unsigned int index, onOff, hue;
+      sscanf(record, "%u %u %u", &index, &onOff, &hue);
+      records++;
+      repeated += seen[index] ? 1 : 0;
+      seen[index] = true;
+      if (index < options.segments)
+      {
+        lastHue[index] = hue;
+      }
+      const char *next = strchr(record, ';');
+      record = next != NULL ? next + 1 : "";
+    }
+  }
+
+  unsigned int stale = 0;
+  for (unsigned int segment = 0; segment < options.segments; segment++)
+  {
+    stale += lastHue[segment] != (int)((updates - 1 + segment) % 360) ? 1 : 0;
+  }
+  events->Disconnect(client);
+
+  AsyncEventSourceClient *resumed = events->Connect(lastId);
+  size_t resumedEvents = resumed->TakeEvents().size();
+  events->Disconnect(resumed);
+
+  printf("State events (%u/s on %u segments, %u s)\n", options.rate, options.segments, options.seconds);
+  printf("  snapshot on connect     %zu events\n", snapshot.size());
+  printf("  changes sent            %u\n", updates * options.segments);
+  printf("  events pushed           %zu, %.1f per second\n", pushed.size(), pushed.size() / (double)options.seconds);
+  printf("  records pushed          %u\n", records);
+  printf("  segment twice per event %u\n", repeated);
+  printf("  ids out of order        %u\n", unordered);
+  printf("  stale last state        %u\n", stale);
+  printf("  events on resume        %zu\n", resumedEvents);
+}
+
+// Several clients flooding /set while one sends a command every 50 ms. The flooding clients have
+// to be turned down with a Retry-After while the network task never blocks.
+static void MeasureFloodingClients(const SimulationOptions &options)
+{
+  const unsigned int FloodingClients = 4;
+  unsigned int floodCodes[600] = {};
+  unsigned int politeCodes[600] = {};
+  unsigned int politeSent = 0;
+  unsigned int missingRetryAfter = 0;
+  int64_t slowest = 0;
+
+  int64_t start = esp_timer_get_time();
+  int64_t nextPolite = start;
+  for (unsigned int i = 0; esp_timer_get_time() - start < 1000000; i++)
+  {
+    for (unsigned int client = 0; client <= FloodingClients; client++)
+    {
+      bool polite = client == FloodingClients;
+      if (polite && esp_timer_get_time() < nextPolite)
+      {
+        continue;
+      }
+
+      char url[64];
+      snprintf(url, sizeof(url), "/set?index=%u&h=%u", client % options.segments, i % 360);
+      AsyncWebServerRequest request(url);
+      request.client()->SetRemoteIP(IPAddress(10, 0, 0, 2 + client));
+      int64_t sent = esp_timer_get_time();
+      webDriver.Dispatch(request);
+      slowest = esp_timer_get_time() - sent > slowest ? esp_timer_get_time() - sent : slowest;
+
+      int code = request.responseCode();
+      (polite ? politeCodes : floodCodes)[code < 600 ? code : 0]++;
+      missingRetryAfter += code != 200 && request.responseHeader("Retry-After") == NULL ? 1 : 0;
+      if (polite)
+      {
+        politeSent++;
+        nextPolite += 50000;
+      }
+    }
+    delayMicroseconds(100);
+  }
+  delay(200);
+
+  printf("Flooding clients (%u clients as fast as possible, one at 20/s, 1 s)\n", FloodingClients);
+  printf("  flooding accepted       %u\n", floodCodes[200]);
+  printf("  flooding 429 / 503      %u / %u\n", floodCodes[429], floodCodes[503]);
+  printf("  polite accepted         %u of %u\n", politeCodes[200], politeSent);
+  printf("  without Retry-After     %u\n", missingRetryAfter);
+  printf("  slowest response        %.3f ms (host)\n", slowest / 1000.0);
+}
+
+// Every pixel of stream frame f carries f in its red and green channels.
+static void FillStreamFrame(uint8_t *channels, uint16_t pixelCount, uint8_t channelsPerPixel, uint16_t frame)
+{
+  for (uint16_t pixel = 0; pixel < pixelCount; pixel++, channels += channelsPerPixel)
+  {
+    channels[0] = frame & 0xff;
+    channels[1] = frame >> 8;
+    channels[2] = 0x55;
+    if (channelsPerPixel == 4)
+    {
+      channels[3] = 0x10;
+    }
+  }
+}
+
+// One RGBW frame in packets of 360 pixels, the last one pushes it.
+static void SendDdpFrame(int udp, const sockaddr_in &target, const uint8_t *channels, uint32_t length, uint8_t sequence)
+{
+  const uint32_t ChunkLength = 1440;
+  uint8_t packet[10 + ChunkLength];
+  for (uint32_t offset = 0; offset < length; offset += ChunkLength)
+  {
+    uint16_t chunk = length - offset < ChunkLength ? length - offset : ChunkLength;
+    bool last = offset + chunk >= length;
+    uint8_t header[10] = {(uint8_t)(0x40 | (last ? 0x01 : 0)), (uint8_t)(sequence & 0x0f), 0x1b, 1,
+                          (uint8_t)(offset >> 24), (uint8_t)(offset >> 16), (uint8_t)(offset >> 8), (uint8_t)offset,
+                          (uint8_t)(chunk >> 8), (uint8_t)chunk};
+    memcpy(packet, header, sizeof(header));
+    memcpy(packet + sizeof(header), channels + offset, chunk);
+    sendto(udp, packet, sizeof(header) + chunk, 0, (const sockaddr *)&target, sizeof(target));
+  }
+}
+
+// One RGB frame as unsynchronized E1.31 data packets of 170 pixels, one per universe.
+static void SendE131Frame(int udp, const sockaddr_in &target, const uint8_t *channels, uint32_t length, uint8_t sequence)
+{
+  static const uint8_t Root[38] = {0x00, 0x10, 0x00, 0x00, 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0,
+                                   0, 0, 0x00, 0x00, 0x00, 0x04};
+  const uint16_t UniverseChannels = RealtimeReceiver::E131PixelsPerUniverse * LED_STRIP_E131_CHANNELS;
+  uint8_t packet[126 + 512];
+  for (uint32_t offset = 0, universe = LED_STRIP_E131_UNIVERSE; offset < length; offset += UniverseChannels, universe++)
+  {
+    uint16_t count = length - offset < UniverseChannels ? length - offset : UniverseChannels;
+    uint16_t packetLength = 126 + count;
+    memset(packet, 0, 126);
+    memcpy(packet, Root, sizeof(Root));
+    packet[16] = 0x70 | ((packetLength - 16) >> 8);
+    packet[17] = packetLength - 16;
+    packet[38] = 0x70 | ((packetLength - 38) >> 8);
+    packet[39] = packetLength - 38;
+    packet[43] = 0x02;
+    strcpy((char *)packet + 44, "simulator");
+    packet[108] = 100;
+    packet[111] = sequence;
+    packet[113] = universe >> 8;
+    packet[114] = universe;
+    packet[115] = 0x70 | ((packetLength - 115) >> 8);
+    packet[116] = packetLength - 115;
+    packet[117] = 0x02;
+    packet[118] = 0xa1;
+    packet[122] = 0x01;
+    packet[123] = (count + 1) >> 8;
+    packet[124] = count + 1;
+    memcpy(packet + 126, channels + offset, count);
+    sendto(udp, packet, packetLength, 0, (const sockaddr *)&target, sizeof(target));
+  }
+}
+
+// Streams numbered frames over the whole strip from a generator thread through a local UDP
+// socket, then checks which of them reached the wire whole and that segment mode returns.
+static void MeasureRealtimeStream(const SimulationOptions &options, uint16_t port)
+{
+  bool ddp = port == RealtimeReceiver::DdpPort;
+  uint8_t channelsPerPixel = ddp ? 4 : LED_STRIP_E131_CHANNELS;
+  uint16_t pixelCount = ledStripDriver->GetPixelCount();
+  unsigned int frameCount = options.streamRate * options.seconds;
+
+  Request("/set?index=0&effect=solid&h=240&s=100&b=100&t=0");
+  delay(200);
+  SimulatedWire::TakeFrames();
+
+  int64_t streamStart = esp_timer_get_time();
+  std::thread generator([&]
+  {
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in target = {};
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::vector<uint8_t> channels(pixelCount * channelsPerPixel);
+    for (unsigned int frame = 0; frame < frameCount; frame++)
+    {
+      int64_t due = streamStart + (int64_t)frame * 1000000 / options.streamRate;
+      while (esp_timer_get_time() < due)
+      {
+        delayMicroseconds(200);
+      }
+      FillStreamFrame(channels.data(), pixelCount, channelsPerPixel, frame);
+      if (ddp)
+        SendDdpFrame(udp, target, channels.data(), channels.size(), frame);
+      else
+        SendE131Frame(udp, target, channels.data(), channels.size(), frame);
+    }
+    close(udp);
+  });
+  generator.join();
+  delay(100);
+  std::vector<SimulatedFrame> frames = SimulatedWire::TakeFrames();
+
+  // A stream frame counts as shown once every output latched it with all of its pixels.
+  std::vector<uint8_t> shownOutputs(frameCount, 0);
+  unsigned int tornFrames = 0;
+  for (const SimulatedFrame &frame : frames)
+  {
+    uint8_t output = 0;
+    while (output < options.outputs && pins[output] != frame.pin)
+    {
+      output++;
+    }
+
+    uint16_t outputPixels = 0;
+    for (unsigned int i = 0; i < options.segments; i++)
+    {
+      const SegmentRange &range = ledStripDriver->GetSegment(i);
+      if (range.output == output && range.length > 0)
+      {
+        uint16_t end = range.start % LedStripDriver::MaxPixelCount + range.length;
+        outputPixels = end > outputPixels ? end : outputPixels;
+      }
+    }
+
+    RgbwColor first = LED_STRIP_FEATURE::retrievePixelColor(frame.bytes.data(), 0);
+    RgbwColor last = LED_STRIP_FEATURE::retrievePixelColor(frame.bytes.data(), outputPixels - 1);
+    unsigned int number = first.R | (first.G << 8);
+    if (first.B != 0x55 || number >= frameCount)
+    {
+      continue;
+    }
+    if (last != first)
+    {
+      tornFrames++;
+      continue;
+    }
+    shownOutputs[number] |= 1 << output;
+  }
+
+  unsigned int shown = 0;
+  for (uint8_t outputs : shownOutputs)
+  {
+    shown += outputs == (1 << options.outputs) - 1 ? 1 : 0;
+  }
+
+  // Segment 0 shows its blue state again once the stream timed out.
+  const SegmentRange &range = ledStripDriver->GetSegment(0);
+  int64_t stopped = esp_timer_get_time();
+  int64_t resumed = 0;
+  while (resumed == 0 && esp_timer_get_time() - stopped < LED_STRIP_REALTIME_TIMEOUT_MILLIS * 2000LL)
+  {
+    delay(10);
+    for (const SimulatedFrame &frame : SimulatedWire::TakeFrames())
+    {
+      RgbwColor pixel = LED_STRIP_FEATURE::retrievePixelColor(frame.bytes.data(), range.start % LedStripDriver::MaxPixelCount);
+      if (resumed == 0 && frame.pin == pins[range.output] && pixel.B > 0 && pixel.B != 0x55)
+      {
+        resumed = frame.latchedMicros;
+      }
+    }
+  }
+
+  printf("Realtime stream (%s, %u pixels at %u fps, %u s)\n", ddp ? "DDP RGBW" : "E1.31 RGB", pixelCount, options.streamRate, options.seconds);
+  printf("  frames shown            %u of %u\n", shown, frameCount);
+  printf("  torn frames             %u\n", tornFrames);
+  if (resumed == 0)
+  {
+    printf("  segments never resumed\n");
+    return;
+  }
+  printf("  segments resumed after  %.0f ms\n", (resumed - stopped) / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+  SimulationOptions options;
+  if (!ParseOptions(argc, argv, options))
+  {
+    fprintf(stderr, "usage: %s [--pixels N] [--segments N] [--outputs N] [--seconds N] [--commands N] [--rate N] [--stream-rate N]\n", argv[0]);
+    return 1;
+  }
+
+  Serial.setMuted(true);
+  for (unsigned int i = 0; i < options.outputs; i++)
+  {
+    pins[i] = i;
+  }
+  ledStripDriver = new LedStripDriver(pins, options.outputs);
+
+  stripStateMailbox.Begin();
+  stripConfigQueue = xQueueCreate(1, sizeof(StripSegment));
+  realtimeReceiver.Init(options.outputs * LedStripDriver::MaxPixelCount);
+  ledStripManager.Init(&stripStateMailbox, stripConfigQueue, ledStripDriver, &realtimeReceiver);
+  realtimeReceiver.Begin();
+  webDriver.SetRenderStatistics(ledStripManager.GetRenderStatistics());
+  webDriver.Init(&stripStateMailbox, stripConfigQueue);
+  ConfigureLayout(options);
+
+  uint32_t wireMicros = SimulatedWire::WireMicros(LedStripDriver::MaxPixelCount * LED_STRIP_FEATURE::PixelSize);
+  printf("Layout\n");
+  printf("  pixels                  %u over %u segments on %u outputs\n", ledStripDriver->GetPixelCount(), options.segments, options.outputs);
+  printf("  wire time per frame     %.2f ms per output (%u pixels each)\n", wireMicros / 1000.0, LedStripDriver::MaxPixelCount);
+  printf("  wire limited rate       %.1f fps\n", 1000000.0 / wireMicros);
+
+  MeasureThroughput(options);
+  MeasureLatency(options);
+  MeasureSocketUpdates(options);
+  MeasureSceneRecall(options);
+  MeasureStateEvents(options);
+  MeasureFloodingClients(options);
+  MeasureRealtimeStream(options, RealtimeReceiver::DdpPort);
+  MeasureRealtimeStream(options, RealtimeReceiver::E131Port);
+  return 0;
+}